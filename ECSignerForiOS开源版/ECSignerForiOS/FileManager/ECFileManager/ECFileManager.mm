@@ -450,12 +450,20 @@ static NSString*  kUnzipDirectoryName = @"Unzip";
 - (BOOL)readMobileProvision:(NSString *)prov_path andFile:(ECMobileProvisionFile *)prov{
     
     char* path = (char*)[prov_path UTF8String];
-    OCTET_STRING_t* xml = dumpMobileProvision(path);
-    if (xml == NULL) {
-        return NO;
-    }
     NSError* error;
-    NSDictionary* obj = [NSPropertyListSerialization propertyListWithData:[NSData dataWithBytes:xml->buf length:xml->size] options:0 format:0 error:&error];
+    NSDictionary* obj = nil;
+    MobileProvisionView_t view;
+    if (mapMobileProvision(path, &view) == 0) {
+        //plist read in place from the mapping, the parsed objects don't point into it
+        obj = [NSPropertyListSerialization propertyListWithData:[NSData dataWithBytesNoCopy:(void*)view.buf length:view.size freeWhenDone:NO] options:0 format:0 error:&error];
+        unmapMobileProvision(&view);
+    } else {
+        OCTET_STRING_t* xml = dumpMobileProvision(path);
+        if (xml == NULL) {
+            return NO;
+        }
+        obj = [NSPropertyListSerialization propertyListWithData:[NSData dataWithBytes:xml->buf length:xml->size] options:0 format:0 error:&error];
+    }
     
     NSString* AppIDName = [obj objectForKey:@"AppIDName"];
     NSString* TeamName = [obj objectForKey:@"TeamName"];
@@ -1,66 +1,266 @@
 #include <stdio.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "SignedXML.h"
+#include "dump-ios-mobileprovision.h"
 
-OCTET_STRING_t* dumpMobileProvision(char *path) {
-    size_t filesize, fread_nitems;
-    FILE *f;
-    char *buf;
-    SignedXML_t *container = 0;
-    asn_dec_rval_t rv;
+#define DER_INDEFINITE ((size_t)-1)
+#define DER_MAX_DEPTH 16
 
-    /* Open the file */
-    f = fopen(path, "rb");
-    if(!f) {
-        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
-//        exit(1);
-        return NULL;
+/* Reads one tag and length, the length is DER_INDEFINITE for the BER indefinite form */
+static int der_header(const uint8_t **pp, const uint8_t *end, uint8_t *tag, size_t *length) {
+    const uint8_t *p = *pp;
+    size_t len, n;
+
+    if(end - p < 2 || (p[0] & 0x1f) == 0x1f) {
+        return -1;  /* multi-byte tags never show up in a profile */
+    }
+    *tag = p[0];
+    len = p[1];
+    p += 2;
+    if(len == 0x80) {
+        if(!(*tag & 0x20)) {
+            return -1;  /* only constructed elements may be indefinite */
+        }
+        len = DER_INDEFINITE;
+    } else if(len & 0x80) {
+        n = len & 0x7f;
+        if(n > sizeof(size_t) || (size_t)(end - p) < n) {
+            return -1;
+        }
+        for(len = 0; n > 0; n--) {
+            len = (len << 8) | *p++;
+        }
+        if(len > (size_t)(end - p)) {
+            return -1;
+        }
+    } else if(len > (size_t)(end - p)) {
+        return -1;
     }
 
-    /* Determine the file's length */
-    fseek(f, 0, SEEK_END);
-    filesize = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    *pp = p;
+    *length = len;
+    return 0;
+}
 
-    /* Allocate memory and read-in file */
-    buf = malloc(filesize);
-    assert(buf);
-    fread_nitems = fread(buf, filesize, 1, f);
-    assert(fread_nitems == 1);
+/* Moves past one element, an indefinite one ends after its end-of-contents octets */
+static int der_skip(const uint8_t **pp, const uint8_t *end, int depth) {
+    uint8_t tag;
+    size_t length;
 
-    /* Grok the file */
-    rv = ber_decode(0, &asn_DEF_SignedXML, (void **)&container, buf, filesize);
-    free(buf);
+    if(depth > DER_MAX_DEPTH || der_header(pp, end, &tag, &length)) {
+        return -1;
+    }
+    if(length != DER_INDEFINITE) {
+        *pp += length;
+        return 0;
+    }
+    while(end - *pp >= 2 && ((*pp)[0] || (*pp)[1])) {
+        if(der_skip(pp, end, depth + 1)) {
+            return -1;
+        }
+    }
+    if(end - *pp < 2) {
+        return -1;
+    }
+    *pp += 2;
+    return 0;
+}
+
+/* Steps into an element with the expected tag, end is narrowed to its content */
+static int der_enter(const uint8_t **pp, const uint8_t **end, uint8_t expected) {
+    uint8_t tag;
+    size_t length;
+
+    if(der_header(pp, *end, &tag, &length) || tag != expected) {
+        return -1;
+    }
+    if(length != DER_INDEFINITE) {
+        *end = *pp + length;
+    }
+    return 0;
+}
+
+static int der_oid(const uint8_t **pp, const uint8_t *end, const uint8_t *oid, size_t size) {
+    if(der_enter(pp, &end, 0x06) || (size_t)(end - *pp) != size || memcmp(*pp, oid, size) != 0) {
+        return -1;
+    }
+    *pp = end;
+    return 0;
+}
+
+/*
+ * ContentInfo { signedData, [0] SignedData { version 1, digestAlgorithms,
+ *     encapContentInfo { data, [0] OCTET STRING } ... } }
+ * Only the path to the plist is walked, the certificates and signers are never touched.
+ */
+static int findProvisionContent(const uint8_t *p, const uint8_t *end, const uint8_t **content, size_t *size) {
+    static const uint8_t oid_signed_data[] = {0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x07, 0x02};
+    static const uint8_t oid_data[] = {0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x07, 0x01};
+    const uint8_t *e;
+
+    if(der_enter(&p, &end, 0x30)
+    || der_oid(&p, end, oid_signed_data, sizeof(oid_signed_data))
+    || der_enter(&p, &end, 0xa0)
+    || der_enter(&p, &end, 0x30)) {
+        return -1;
+    }
+
+    e = end;
+    if(der_enter(&p, &e, 0x02) || e - p != 1 || *p != 1) {
+        return -1;
+    }
+    p = e;
+
+    if(der_skip(&p, end, 0)
+    || der_enter(&p, &end, 0x30)
+    || der_oid(&p, end, oid_data, sizeof(oid_data))
+    || der_enter(&p, &end, 0xa0)) {
+        return -1;
+    }
+
+    /* A constructed OCTET STRING is not contiguous, that one is left to asn1c */
+    e = end;
+    if(der_enter(&p, &e, 0x04)) {
+        return -1;
+    }
+    *content = p;
+    *size = e - p;
+    return 0;
+}
+
+int mapMobileProvision(const char *path, MobileProvisionView_t *view) {
+    struct stat st;
+    int fd;
+
+    memset(view, 0, sizeof(*view));
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return -1;
+    }
+    if(fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return -1;
+    }
+
+    view->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(view->map == MAP_FAILED) {
+        view->map = NULL;
+        return -1;
+    }
+    view->map_size = (size_t)st.st_size;
+
+    if(findProvisionContent((const uint8_t *)view->map, (const uint8_t *)view->map + view->map_size, &view->buf, &view->size)) {
+        unmapMobileProvision(view);
+        return -1;
+    }
+    return 0;
+}
+
+void unmapMobileProvision(MobileProvisionView_t *view) {
+    if(view->map) {
+        munmap(view->map, view->map_size);
+    }
+    memset(view, 0, sizeof(*view));
+}
+
+static SignedXML_t* decodeSignedXML(const char *path, const void *buf, size_t size) {
+    SignedXML_t *container = 0;
+    asn_dec_rval_t rv;
 
+    rv = ber_decode(0, &asn_DEF_SignedXML, (void **)&container, buf, size);
     switch(rv.code) {
     case RC_OK:
         break;
     case RC_FAIL:
         fprintf(stderr, "%s: wrong file format\n", path);
-//        exit(1);
-            return NULL;
+        ASN_STRUCT_FREE(asn_DEF_SignedXML, container);
+        return NULL;
     case RC_WMORE:
         fprintf(stderr, "%s: truncated file\n", path);
-//        exit(1);
-            return NULL;
+        ASN_STRUCT_FREE(asn_DEF_SignedXML, container);
+        return NULL;
     }
 
     /* Sanity-check the PKCS#7, make sure it is SignedData */
     {
     int oid1[7], oid1_test[7] = {1,2,840,113549,1,7,2};
     int oid2[7], oid2_test[7] = {1,2,840,113549,1,7,1};
-    int ret;
-    ret = OBJECT_IDENTIFIER_get_arcs(&container->contentType,
+    int ret1, ret2;
+    ret1 = OBJECT_IDENTIFIER_get_arcs(&container->contentType,
         oid1, sizeof(oid1[0]), sizeof(oid1)/sizeof(oid1[0]));
-      assert(ret == 7);
-      assert(memcmp(oid1, oid1_test, sizeof(oid1)) == 0);
-    assert(container->content.version == 1);
-    ret = OBJECT_IDENTIFIER_get_arcs(&container->content.contentInfo.contentType,
+    ret2 = OBJECT_IDENTIFIER_get_arcs(&container->content.contentInfo.contentType,
         oid2, sizeof(oid2[0]), sizeof(oid2)/sizeof(oid2[0]));
-      assert(ret == 7);
-      assert(memcmp(oid2, oid2_test, sizeof(oid2)) == 0);
+    if(ret1 != 7 || memcmp(oid1, oid1_test, sizeof(oid1)) != 0
+    || container->content.version != 1
+    || ret2 != 7 || memcmp(oid2, oid2_test, sizeof(oid2)) != 0) {
+        fprintf(stderr, "%s: not a signed provision\n", path);
+        ASN_STRUCT_FREE(asn_DEF_SignedXML, container);
+        return NULL;
+    }
+    }
+    return container;
+}
+
+static char* readProvisionFile(const char *path, size_t *filesize) {
+    size_t fread_nitems;
+    long length;
+    FILE *f;
+    char *buf;
+
+    /* Open the file */
+    f = fopen(path, "rb");
+    if(!f) {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+//        exit(1);
+        return NULL;
+    }
+
+    /* Determine the file's length */
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if(length <= 0) {
+        fprintf(stderr, "%s: empty file\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    /* Allocate memory and read-in file */
+    buf = malloc(length);
+    assert(buf);
+    fread_nitems = fread(buf, length, 1, f);
+    fclose(f);
+    if(fread_nitems != 1) {
+        fprintf(stderr, "%s: truncated file\n", path);
+        free(buf);
+        return NULL;
+    }
+    *filesize = (size_t)length;
+    return buf;
+}
+
+OCTET_STRING_t* dumpMobileProvision(char *path) {
+    size_t filesize = 0;
+    char *buf;
+    SignedXML_t *container = 0;
+
+    buf = readProvisionFile(path, &filesize);
+    if(!buf) {
+        return NULL;
+    }
+
+    /* Grok the file, the decoded strings are copies so the buffer can go */
+    container = decodeSignedXML(path, buf, filesize);
+    free(buf);
+    if(!container) {
+        return NULL;
     }
 
     OCTET_STRING_t *xml;
@@ -69,3 +269,78 @@ OCTET_STRING_t* dumpMobileProvision(char *path) {
 //    char* content = (char*)xml->buf;
     return xml;
 }
+
+#ifdef PROVISION_DUMP_BENCHMARK
+
+#include <time.h>
+
+static double benchmarkNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Decodes every profile `rounds` times through asn1c and through the mapping, and checks both agree */
+void benchmarkMobileProvision(char **paths, int count, int rounds) {
+    double asn1c_time = 0, walker_time = 0, start;
+    int i, r, profiles = 0, mismatches = 0, fallbacks = 0;
+
+    for(i = 0; i < count; i++) {
+        MobileProvisionView_t view;
+        SignedXML_t *container = 0;
+        size_t filesize = 0;
+        char *buf;
+
+        /* Files asn1c rejects are reported once and left out of the timing */
+        buf = readProvisionFile(paths[i], &filesize);
+        if(!buf) {
+            continue;
+        }
+        container = decodeSignedXML(paths[i], buf, filesize);
+        free(buf);
+        if(!container) {
+            continue;
+        }
+        ASN_STRUCT_FREE(asn_DEF_SignedXML, container);
+        container = 0;
+        profiles++;
+
+        /* Both paths read the file each round, as dumpMobileProvision does */
+        start = benchmarkNow();
+        for(r = 0; r < rounds; r++) {
+            ASN_STRUCT_FREE(asn_DEF_SignedXML, container);
+            buf = readProvisionFile(paths[i], &filesize);
+            container = buf ? decodeSignedXML(paths[i], buf, filesize) : 0;
+            free(buf);
+        }
+        asn1c_time += benchmarkNow() - start;
+
+        memset(&view, 0, sizeof(view));
+        start = benchmarkNow();
+        for(r = 0; r < rounds; r++) {
+            unmapMobileProvision(&view);
+            if(mapMobileProvision(paths[i], &view)) {
+                break;
+            }
+        }
+        walker_time += benchmarkNow() - start;
+
+        if(!view.map) {
+            fallbacks++;
+        } else if(!container || (size_t)container->content.contentInfo.contentXML.size != view.size
+        || memcmp(container->content.contentInfo.contentXML.buf, view.buf, view.size) != 0) {
+            fprintf(stderr, "%s: decoders disagree\n", paths[i]);
+            mismatches++;
+        }
+        unmapMobileProvision(&view);
+        ASN_STRUCT_FREE(asn_DEF_SignedXML, container);
+    }
+
+    if(profiles > 0 && rounds > 0) {
+        fprintf(stderr, "asn1c:  %.3f ms/profile\n", asn1c_time * 1e3 / ((double)profiles * rounds));
+        fprintf(stderr, "walker: %.3f ms/profile\n", walker_time * 1e3 / ((double)profiles * rounds));
+    }
+    fprintf(stderr, "%d of %d profiles decoded, %d left to asn1c, %d mismatches\n", profiles, count, fallbacks, mismatches);
+}
+
+#endif /* PROVISION_DUMP_BENCHMARK */
@@ -6,16 +6,34 @@
 //  Copyright © 2020 even_cheng. All rights reserved.
 //
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 
 #include "OCTET_STRING.h"
 
 extern "C" {
 #endif
-    
-    
+
+    /* The plist of a profile, read in place from a read-only mapping of the file */
+    typedef struct MobileProvisionView {
+        const uint8_t *buf;
+        size_t size;
+        void *map;
+        size_t map_size;
+    } MobileProvisionView_t;
+
     OCTET_STRING_t* dumpMobileProvision(char *path);
-    
+
+    /* 0 on success, -1 if the file can't be mapped or is not plain DER/BER, dumpMobileProvision decodes the rest */
+    int mapMobileProvision(const char *path, MobileProvisionView_t *view);
+    void unmapMobileProvision(MobileProvisionView_t *view);
+
+#ifdef PROVISION_DUMP_BENCHMARK
+    void benchmarkMobileProvision(char **paths, int count, int rounds);
+#endif
+
 #ifdef __cplusplus
 }
 
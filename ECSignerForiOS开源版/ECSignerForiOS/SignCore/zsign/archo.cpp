@@ -3,6 +3,405 @@
 #include "archo.h"
 #include "signing.h"
 
+//load command parsing and editing, specialized per slice layout, so field sizes and byte order are fixed at compile time
+template <bool Is64>
+struct ZMachOTypes
+{
+	typedef mach_header header;
+	typedef segment_command segment;
+	typedef section sect;
+	typedef uint32_t uintx;
+	enum
+	{
+		LC_SEGMENT_X = LC_SEGMENT
+	};
+};
+
+template <>
+struct ZMachOTypes<true>
+{
+	typedef mach_header_64 header;
+	typedef segment_command_64 segment;
+	typedef section_64 sect;
+	typedef uint64_t uintx;
+	enum
+	{
+		LC_SEGMENT_X = LC_SEGMENT_64
+	};
+};
+
+struct ZArchOParser
+{
+	bool (*Parse)(ZArchO *pArchO);
+	bool (*PlanLoadCommands)(ZArchO *pArchO, const vector<ZLoadCommandEdit> &arrEdits, string &strCommands, uint32_t &uCommandCount);
+	bool (*ApplyLoadCommands)(ZArchO *pArchO, const string &strCommands, uint32_t uCommandCount, bool &bChanged);
+	bool (*ResizeCodeSignature)(ZArchO *pArchO, uint32_t uNewLength);
+};
+
+template <bool Is64, bool Swap>
+class ZArchOParserT
+{
+	typedef ZMachOTypes<Is64> T;
+	typedef typename T::header header_t;
+	typedef typename T::segment segment_t;
+	typedef typename T::sect sect_t;
+	typedef typename T::uintx uintx_t;
+
+public:
+	static const ZArchOParser s_parser;
+
+private:
+	template <typename V>
+	static V O(V value)
+	{
+		return Swap ? _Swap(value) : value;
+	}
+
+	static header_t *Header(ZArchO *pArchO)
+	{
+		return (header_t *)pArchO->m_pBase;
+	}
+
+	//stops at the first truncated command instead of walking out of the slice
+	static load_command *NextLoadCommand(ZArchO *pArchO, uint8_t *&pLoadCommand, uint32_t &uIndex)
+	{
+		uint8_t *pEnd = pArchO->m_pBase + pArchO->m_uLength;
+		if (uIndex >= O(Header(pArchO)->ncmds) || pLoadCommand + sizeof(load_command) > pEnd)
+		{
+			return NULL;
+		}
+
+		load_command *plc = (load_command *)pLoadCommand;
+		uint32_t uCmdSize = O(plc->cmdsize);
+		if (uCmdSize < sizeof(load_command) || pLoadCommand + uCmdSize > pEnd)
+		{
+			return NULL;
+		}
+		pLoadCommand += uCmdSize;
+		uIndex++;
+		return plc;
+	}
+
+	static uint32_t AddLoadCommand(ZArchO *pArchO, load_command *plc)
+	{
+		ZLoadCommand lc;
+		lc.uCmd = O(plc->cmd);
+		lc.uOffset = (uint32_t)((uint8_t *)plc - pArchO->m_pBase);
+		lc.uSize = O(plc->cmdsize);
+		pArchO->m_arrLoadCommands.push_back(lc);
+		uint32_t uCommand = (uint32_t)pArchO->m_arrLoadCommands.size() - 1;
+		pArchO->m_mapLoadCommands.insert(make_pair(lc.uCmd, uCommand));
+		return uCommand;
+	}
+
+	static void AddDyLib(ZArchO *pArchO, dylib_command *dlc, uint32_t uCommand)
+	{
+		uint32_t uNameOffset = O(dlc->dylib.name.offset);
+		if (uNameOffset < sizeof(dylib_command) || uNameOffset >= O(dlc->cmdsize))
+		{
+			return;
+		}
+
+		ZDyLib dylib;
+		dylib.uCommand = uCommand;
+		dylib.szPath = (const char *)dlc + uNameOffset;
+		dylib.bWeak = (LC_LOAD_WEAK_DYLIB == O(dlc->cmd));
+		pArchO->m_arrDyLibs.push_back(dylib);
+		pArchO->m_mapDyLibs.insert(make_pair(string(dylib.szPath, strnlen(dylib.szPath, O(dlc->cmdsize) - uNameOffset)), (uint32_t)pArchO->m_arrDyLibs.size() - 1));
+	}
+
+	static bool Parse(ZArchO *pArchO)
+	{
+		header_t *pHeader = Header(pArchO);
+		uint32_t uCommandsEnd = O(pHeader->sizeofcmds) + sizeof(header_t);
+
+		uint32_t uIndex = 0;
+		uint8_t *pLoadCommand = pArchO->m_pBase + sizeof(header_t);
+		for (load_command *plc = NextLoadCommand(pArchO, pLoadCommand, uIndex); NULL != plc; plc = NextLoadCommand(pArchO, pLoadCommand, uIndex))
+		{
+			uint32_t uCommand = AddLoadCommand(pArchO, plc);
+			switch (O(plc->cmd))
+			{
+			case T::LC_SEGMENT_X:
+			{
+				segment_t *seglc = (segment_t *)plc;
+				if (0 == strcmp("__TEXT", seglc->segname))
+				{
+					pArchO->m_pTextSegment = (uint8_t *)plc;
+					for (uint32_t j = 0; j < O(seglc->nsects); j++)
+					{
+						sect_t *sect = (sect_t *)((uint8_t *)seglc + sizeof(segment_t) + sizeof(sect_t) * j);
+						if (0 == strcmp("__text", sect->sectname))
+						{
+							if (O(sect->offset) > uCommandsEnd)
+							{
+								pArchO->m_uLoadCommandsFreeSpace = O(sect->offset) - uCommandsEnd;
+							}
+						}
+						else if (0 == strcmp("__info_plist", sect->sectname))
+						{
+							if (NULL == pArchO->m_pInfoPlist && (uint64_t)O(sect->offset) + O(sect->size) <= pArchO->m_uLength)
+							{
+								pArchO->m_pInfoPlist = (const char *)pArchO->m_pBase + O(sect->offset);
+								pArchO->m_uInfoPlistLength = (uint32_t)O(sect->size);
+							}
+						}
+					}
+				}
+				else if (0 == strcmp("__LINKEDIT", seglc->segname))
+				{
+					pArchO->m_pLinkEditSegment = (uint8_t *)plc;
+				}
+			}
+			break;
+			case LC_ENCRYPTION_INFO:
+			case LC_ENCRYPTION_INFO_64:
+			{
+				encryption_info_command *crypt_cmd = (encryption_info_command *)plc;
+				pArchO->m_pEncryptionInfo = (uint8_t *)plc;
+				if (O(crypt_cmd->cryptid) >= 1)
+				{
+					pArchO->m_bEncrypted = true;
+				}
+			}
+			break;
+			case LC_CODE_SIGNATURE:
+			{
+				codesignature_command *pcslc = (codesignature_command *)plc;
+				pArchO->m_pCodeSignSegment = (uint8_t *)plc;
+				pArchO->m_uCodeLength = O(pcslc->dataoff);
+				pArchO->m_pSignBase = pArchO->m_pBase + pArchO->m_uCodeLength;
+				pArchO->m_uSignLength = GetCodeSignatureLength(pArchO->m_pSignBase);
+			}
+			break;
+			case LC_LOAD_DYLIB:
+			case LC_LOAD_WEAK_DYLIB:
+			{
+				AddDyLib(pArchO, (dylib_command *)plc, uCommand);
+			}
+			break;
+			}
+		}
+		return true;
+	}
+
+	//dylib_command and rpath_command both keep their string offset right after cmdsize
+	static string GetCommandString(const string &strCommand)
+	{
+		if (strCommand.size() < sizeof(load_command) + sizeof(uint32_t))
+		{
+			return "";
+		}
+
+		uint32_t uOffset = O(*((uint32_t *)(strCommand.data() + sizeof(load_command))));
+		if (uOffset >= strCommand.size())
+		{
+			return "";
+		}
+		return string(strCommand.data() + uOffset, strnlen(strCommand.data() + uOffset, strCommand.size() - uOffset));
+	}
+
+	static uint32_t GetCommandType(const string &strCommand)
+	{
+		return O(((load_command *)strCommand.data())->cmd);
+	}
+
+	static bool IsDyLibCommand(const string &strCommand)
+	{
+		uint32_t uCmd = GetCommandType(strCommand);
+		return (LC_LOAD_DYLIB == uCmd || LC_LOAD_WEAK_DYLIB == uCmd);
+	}
+
+	static int FindCommand(const vector<string> &arrCommands, bool bDyLib, const string &strPath)
+	{
+		for (size_t i = 0; i < arrCommands.size(); i++)
+		{
+			bool bMatch = bDyLib ? IsDyLibCommand(arrCommands[i]) : (LC_RPATH == GetCommandType(arrCommands[i]));
+			if (bMatch && strPath == GetCommandString(arrCommands[i]))
+			{
+				return (int)i;
+			}
+		}
+		return -1;
+	}
+
+	static string NewStringCommand(uint32_t uCmd, uint32_t uHeaderSize, const string &strPath)
+	{ //the string is padded to 8 bytes and always ends with at least one zero
+		uint32_t uPathLength = (uint32_t)strPath.size();
+		uint32_t uCommandSize = uHeaderSize + uPathLength + (8 - (uHeaderSize + uPathLength) % 8);
+
+		string strCommand;
+		strCommand.append(uCommandSize, 0);
+		uint32_t *pFields = (uint32_t *)strCommand.data();
+		pFields[0] = O(uCmd);
+		pFields[1] = O(uCommandSize);
+		pFields[2] = O(uHeaderSize);
+		memcpy((uint8_t *)strCommand.data() + uHeaderSize, strPath.data(), uPathLength);
+		return strCommand;
+	}
+
+	//works on a copy of the load commands, so a slice is only written once every edit fits
+	static bool PlanLoadCommands(ZArchO *pArchO, const vector<ZLoadCommandEdit> &arrEdits, string &strCommands, uint32_t &uCommandCount)
+	{
+		vector<string> arrCommands;
+		for (size_t i = 0; i < pArchO->m_arrLoadCommands.size(); i++)
+		{
+			const ZLoadCommand &lc = pArchO->m_arrLoadCommands[i];
+			arrCommands.push_back(string((const char *)pArchO->m_pBase + lc.uOffset, lc.uSize));
+		}
+
+		for (size_t i = 0; i < arrEdits.size(); i++)
+		{
+			const ZLoadCommandEdit &edit = arrEdits[i];
+			switch (edit.uType)
+			{
+			case E_LOAD_COMMAND_INJECT:
+			{
+				uint32_t uNewType = edit.bWeak ? LC_LOAD_WEAK_DYLIB : LC_LOAD_DYLIB;
+				int nIndex = FindCommand(arrCommands, true, edit.strPath);
+				if (nIndex < 0)
+				{
+					string strCommand = NewStringCommand(uNewType, sizeof(dylib_command), edit.strPath);
+					((dylib_command *)strCommand.data())->dylib.timestamp = O((uint32_t)2);
+					arrCommands.push_back(strCommand);
+				}
+				else if (uNewType != GetCommandType(arrCommands[nIndex]))
+				{
+					((load_command *)arrCommands[nIndex].data())->cmd = O(uNewType);
+					ZLog::WarnV(">>> DyLib Load Type Changed! %s -> %s\n", edit.bWeak ? "LC_LOAD_DYLIB" : "LC_LOAD_WEAK_DYLIB", edit.bWeak ? "LC_LOAD_WEAK_DYLIB" : "LC_LOAD_DYLIB");
+				}
+				else
+				{
+					ZLog::WarnV(">>> DyLib Is Already Existed! %s\n", edit.strPath.c_str());
+				}
+			}
+			break;
+			case E_LOAD_COMMAND_REMOVE:
+			{
+				int nIndex = FindCommand(arrCommands, true, edit.strPath);
+				if (nIndex < 0)
+				{
+					ZLog::WarnV(">>> DyLib Is Not Existed! %s\n", edit.strPath.c_str());
+				}
+				else
+				{
+					arrCommands.erase(arrCommands.begin() + nIndex);
+				}
+			}
+			break;
+			case E_LOAD_COMMAND_RPATH:
+			{
+				if (FindCommand(arrCommands, false, edit.strPath) < 0)
+				{
+					arrCommands.push_back(NewStringCommand(LC_RPATH, sizeof(rpath_command), edit.strPath));
+				}
+				else
+				{
+					ZLog::WarnV(">>> RPath Is Already Existed! %s\n", edit.strPath.c_str());
+				}
+			}
+			break;
+			default:
+				ZLog::ErrorV(">>> Unknown LoadCommand Edit! %u\n", edit.uType);
+				return false;
+			}
+		}
+
+		strCommands.clear();
+		for (size_t i = 0; i < arrCommands.size(); i++)
+		{
+			strCommands += arrCommands[i];
+		}
+		uCommandCount = (uint32_t)arrCommands.size();
+
+		uint32_t uSpace = O(Header(pArchO)->sizeofcmds) + pArchO->m_uLoadCommandsFreeSpace;
+		if (strCommands.size() > uSpace)
+		{
+			ZLog::ErrorV(">>> Can't Find Free Space Of LoadCommands! need %u bytes, only %u bytes\n", (uint32_t)strCommands.size(), uSpace);
+			return false;
+		}
+		return true;
+	}
+
+	static bool ApplyLoadCommands(ZArchO *pArchO, const string &strCommands, uint32_t uCommandCount, bool &bChanged)
+	{
+		header_t *pHeader = Header(pArchO);
+		uint8_t *pCommands = pArchO->m_pBase + sizeof(header_t);
+		uint32_t uOldSize = O(pHeader->sizeofcmds);
+		uint32_t uNewSize = (uint32_t)strCommands.size();
+
+		uint32_t uFirst = 0;
+		while (uFirst < uOldSize && uFirst < uNewSize && pCommands[uFirst] == (uint8_t)strCommands[uFirst])
+		{
+			uFirst++;
+		}
+		if (uFirst == uOldSize && uFirst == uNewSize && uCommandCount == O(pHeader->ncmds))
+		{
+			return true;
+		}
+
+		memcpy(pCommands + uFirst, strCommands.data() + uFirst, uNewSize - uFirst);
+		if (uOldSize > uNewSize)
+		{
+			memset(pCommands + uNewSize, 0, uOldSize - uNewSize);
+		}
+		pHeader->ncmds = O(uCommandCount);
+		pHeader->sizeofcmds = O(uNewSize);
+		pArchO->MarkDirty(0, sizeof(header_t));
+		pArchO->MarkDirty((uint32_t)sizeof(header_t) + uFirst, max(uOldSize, uNewSize) - uFirst);
+
+		bChanged = true;
+		return pArchO->IndexLoadCommands();
+	}
+
+	static bool ResizeCodeSignature(ZArchO *pArchO, uint32_t uNewLength)
+	{
+		header_t *pHeader = Header(pArchO);
+		segment_t *seglc = (segment_t *)pArchO->m_pLinkEditSegment;
+		if (NULL == seglc)
+		{
+			return false;
+		}
+
+		uintx_t uVMSize = O(seglc->vmsize) + (uNewLength - pArchO->m_uLength);
+		seglc->vmsize = O((uintx_t)((uVMSize + 4095) & ~(uintx_t)4095));
+		seglc->filesize = O((uintx_t)(uNewLength - O(seglc->fileoff)));
+		pArchO->MarkDirty((uint32_t)((uint8_t *)seglc - pArchO->m_pBase), sizeof(segment_t));
+
+		codesignature_command *pcslc = (codesignature_command *)pArchO->m_pCodeSignSegment;
+		if (NULL == pcslc)
+		{
+			if (pArchO->m_uLoadCommandsFreeSpace < sizeof(codesignature_command))
+			{
+				ZLog::Error(">>> Can't Find Free Space Of LoadCommands For CodeSignature!\n");
+				return false;
+			}
+
+			pcslc = (codesignature_command *)(pArchO->m_pBase + sizeof(header_t) + O(pHeader->sizeofcmds));
+			pcslc->cmd = O((uint32_t)LC_CODE_SIGNATURE);
+			pcslc->cmdsize = O((uint32_t)sizeof(codesignature_command));
+			pcslc->dataoff = O(pArchO->m_uCodeLength);
+			pHeader->ncmds = O(O(pHeader->ncmds) + 1);
+			pHeader->sizeofcmds = O((uint32_t)(O(pHeader->sizeofcmds) + sizeof(codesignature_command)));
+			pArchO->m_uLoadCommandsFreeSpace -= sizeof(codesignature_command);
+			pArchO->MarkDirty(0, sizeof(header_t));
+			pArchO->m_pCodeSignSegment = (uint8_t *)pcslc;
+			AddLoadCommand(pArchO, (load_command *)pcslc);
+		}
+		pcslc->datasize = O(uNewLength - pArchO->m_uCodeLength);
+		pArchO->MarkDirty((uint32_t)((uint8_t *)pcslc - pArchO->m_pBase), sizeof(codesignature_command));
+		return true;
+	}
+};
+
+template <bool Is64, bool Swap>
+const ZArchOParser ZArchOParserT<Is64, Swap>::s_parser = {
+	&ZArchOParserT<Is64, Swap>::Parse,
+	&ZArchOParserT<Is64, Swap>::PlanLoadCommands,
+	&ZArchOParserT<Is64, Swap>::ApplyLoadCommands,
+	&ZArchOParserT<Is64, Swap>::ResizeCodeSignature,
+};
+
 ZArchO::ZArchO()
 {
 	m_pBase = NULL;
@@ -15,10 +414,16 @@ ZArchO::ZArchO()
 	m_bEncrypted = false;
 	m_b64 = false;
 	m_bBigEndian = false;
-	m_bEnoughSpace = true;
+	m_uSignLengthNeeded = 0;
+	m_pInfoPlist = NULL;
+	m_uInfoPlistLength = 0;
+	m_pTextSegment = NULL;
 	m_pCodeSignSegment = NULL;
 	m_pLinkEditSegment = NULL;
+	m_pEncryptionInfo = NULL;
 	m_uLoadCommandsFreeSpace = 0;
+	m_pParser = NULL;
+	m_szFile = NULL;
 }
 
 bool ZArchO::Init(uint8_t *pBase, uint32_t uLength)
@@ -35,92 +440,46 @@ bool ZArchO::Init(uint8_t *pBase, uint32_t uLength)
 	m_b64 = (MH_MAGIC_64 == m_pHeader->magic || MH_CIGAM_64 == m_pHeader->magic) ? true : false;
 	m_bBigEndian = (MH_CIGAM == m_pHeader->magic || MH_CIGAM_64 == m_pHeader->magic) ? true : false;
 	m_uHeaderSize = m_b64 ? sizeof(mach_header_64) : sizeof(mach_header);
+	if (uLength < m_uHeaderSize)
+	{
+		return false;
+	}
 
-	uint8_t *pLoadCommand = m_pBase + m_uHeaderSize;
-	for (uint32_t i = 0; i < BO(m_pHeader->ncmds); i++)
+	switch (m_pHeader->magic)
 	{
-		load_command *plc = (load_command *)pLoadCommand;
-		switch (BO(plc->cmd))
-		{
-		case LC_SEGMENT:
-		{
-			segment_command *seglc = (segment_command *)pLoadCommand;
-			if (0 == strcmp("__TEXT", seglc->segname))
-			{
-				for (uint32_t j = 0; j < BO(seglc->nsects); j++)
-				{
-					section *sect = (section *)((pLoadCommand + sizeof(segment_command)) + sizeof(section) * j);
-					if (0 == strcmp("__text", sect->sectname))
-					{
-						if (BO(sect->offset) > (BO(m_pHeader->sizeofcmds) + m_uHeaderSize))
-						{
-							m_uLoadCommandsFreeSpace = BO(sect->offset) - BO(m_pHeader->sizeofcmds) - m_uHeaderSize;
-						}
-					}
-					else if (0 == strcmp("__info_plist", sect->sectname))
-					{
-						m_strInfoPlist.append((const char *)m_pBase + BO(sect->offset), BO(sect->size));
-					}
-				}
-			}
-			else if (0 == strcmp("__LINKEDIT", seglc->segname))
-			{
-				m_pLinkEditSegment = pLoadCommand;
-			}
-		}
+	case MH_MAGIC:
+		m_pParser = &ZArchOParserT<false, false>::s_parser;
 		break;
-		case LC_SEGMENT_64:
-		{
-			segment_command_64 *seglc = (segment_command_64 *)pLoadCommand;
-			if (0 == strcmp("__TEXT", seglc->segname))
-			{
-				for (uint32_t j = 0; j < BO(seglc->nsects); j++)
-				{
-					section_64 *sect = (section_64 *)((pLoadCommand + sizeof(segment_command_64)) + sizeof(section_64) * j);
-					if (0 == strcmp("__text", sect->sectname))
-					{
-						if (BO(sect->offset) > (BO(m_pHeader->sizeofcmds) + m_uHeaderSize))
-						{
-							m_uLoadCommandsFreeSpace = BO(sect->offset) - BO(m_pHeader->sizeofcmds) - m_uHeaderSize;
-						}
-					}
-					else if (0 == strcmp("__info_plist", sect->sectname))
-					{
-						m_strInfoPlist.append((const char *)m_pBase + BO(sect->offset), BO(sect->size));
-					}
-				}
-			}
-			else if (0 == strcmp("__LINKEDIT", seglc->segname))
-			{
-				m_pLinkEditSegment = pLoadCommand;
-			}
-		}
+	case MH_CIGAM:
+		m_pParser = &ZArchOParserT<false, true>::s_parser;
 		break;
-		case LC_ENCRYPTION_INFO:
-		case LC_ENCRYPTION_INFO_64:
-		{
-			encryption_info_command *crypt_cmd = (encryption_info_command *)pLoadCommand;
-			if (BO(crypt_cmd->cryptid) >= 1)
-			{
-				m_bEncrypted = true;
-			}
-		}
+	case MH_MAGIC_64:
+		m_pParser = &ZArchOParserT<true, false>::s_parser;
 		break;
-		case LC_CODE_SIGNATURE:
-		{
-			codesignature_command *pcslc = (codesignature_command *)pLoadCommand;
-			m_pCodeSignSegment = pLoadCommand;
-			m_uCodeLength = BO(pcslc->dataoff);
-			m_pSignBase = m_pBase + m_uCodeLength;
-			m_uSignLength = GetCodeSignatureLength(m_pSignBase);
-		}
+	case MH_CIGAM_64:
+		m_pParser = &ZArchOParserT<true, true>::s_parser;
 		break;
-		}
-
-		pLoadCommand += BO(plc->cmdsize);
+	default:
+		return false;
 	}
+	return IndexLoadCommands();
+}
 
-	return true;
+bool ZArchO::IndexLoadCommands()
+{
+	m_arrLoadCommands.clear();
+	m_arrDyLibs.clear();
+	m_mapLoadCommands.clear();
+	m_mapDyLibs.clear();
+	m_pInfoPlist = NULL;
+	m_uInfoPlistLength = 0;
+	m_pTextSegment = NULL;
+	m_pCodeSignSegment = NULL;
+	m_pLinkEditSegment = NULL;
+	m_pEncryptionInfo = NULL;
+	m_uLoadCommandsFreeSpace = 0;
+	m_bEncrypted = false;
+	return m_pParser->Parse(this);
 }
 
 const char *ZArchO::GetArch(int cpuType, int cpuSubType)
@@ -248,6 +607,15 @@ uint32_t ZArchO::BO(uint32_t uValue)
 	return m_bBigEndian ? LE(uValue) : uValue;
 }
 
+const char *ZArchO::GetArchName()
+{
+	if (NULL == m_pHeader)
+	{
+		return "unknown";
+	}
+	return GetArch(BO(m_pHeader->cputype), BO(m_pHeader->cpusubtype) & ~CPU_SUBTYPE_MASK);
+}
+
 bool ZArchO::IsExecute()
 {
 	if (NULL != m_pHeader)
@@ -279,68 +647,56 @@ void ZArchO::PrintInfo()
 	ZLog::PrintV("\tSignLength: \t%d (%s)\n", m_uSignLength, FormatSize(m_uSignLength).c_str());
 	ZLog::PrintV("\tSpareLength: \t%d (%s)\n", m_uLength - m_uCodeLength - m_uSignLength, FormatSize(m_uLength - m_uCodeLength - m_uSignLength).c_str());
 	
-	uint8_t *pLoadCommand = m_pBase + m_uHeaderSize;
-	for (uint32_t i = 0; i < BO(m_pHeader->ncmds); i++)
+	for (size_t i = 0; i < m_arrLoadCommands.size(); i++)
 	{
-		load_command *plc = (load_command *)pLoadCommand;
-		if (LC_VERSION_MIN_IPHONEOS == BO(plc->cmd))
+		const ZLoadCommand &lc = m_arrLoadCommands[i];
+		if (LC_VERSION_MIN_IPHONEOS == lc.uCmd)
 		{
-			ZLog::PrintV("\tMIN_IPHONEOS: \t0x%x\n", *((uint32_t*)(pLoadCommand + sizeof(load_command))));
+			ZLog::PrintV("\tMIN_IPHONEOS: \t0x%x\n", BO(*((uint32_t *)(m_pBase + lc.uOffset + sizeof(load_command)))));
 		}
-		else if(LC_RPATH == BO(plc->cmd))
+		else if (LC_RPATH == lc.uCmd)
 		{
-			ZLog::PrintV("\tLC_RPATH: \t%s\n", (char*)(pLoadCommand + sizeof(load_command) + 4));
+			ZLog::PrintV("\tLC_RPATH: \t%s\n", (char *)(m_pBase + lc.uOffset + sizeof(load_command) + 4));
 		}
-		pLoadCommand += BO(plc->cmdsize);
 	}
 
 	bool bHasWeakDylib = false;
 	ZLog::PrintV("\tLC_LOAD_DYLIB: \n");
-	pLoadCommand = m_pBase + m_uHeaderSize;
-	for (uint32_t i = 0; i < BO(m_pHeader->ncmds); i++)
+	for (size_t i = 0; i < m_arrDyLibs.size(); i++)
 	{
-		load_command *plc = (load_command *)pLoadCommand;
-		if (LC_LOAD_DYLIB == BO(plc->cmd))
+		if (m_arrDyLibs[i].bWeak)
 		{
-			dylib_command *dlc = (dylib_command *)pLoadCommand;
-			const char *szDyLib = (const char *)(pLoadCommand + BO(dlc->dylib.name.offset));
-			ZLog::PrintV("\t\t\t%s\n", szDyLib);
+			bHasWeakDylib = true;
 		}
-		else if (LC_LOAD_WEAK_DYLIB == BO(plc->cmd))
+		else
 		{
-			bHasWeakDylib = true;
+			ZLog::PrintV("\t\t\t%s\n", m_arrDyLibs[i].szPath);
 		}
-		pLoadCommand += BO(plc->cmdsize);
 	}
 
-	if(bHasWeakDylib)
+	if (bHasWeakDylib)
 	{
 		ZLog::PrintV("\tLC_LOAD_WEAK_DYLIB: \n");
-		pLoadCommand = m_pBase + m_uHeaderSize;
-		for (uint32_t i = 0; i < BO(m_pHeader->ncmds); i++)
+		for (size_t i = 0; i < m_arrDyLibs.size(); i++)
 		{
-			load_command *plc = (load_command *)pLoadCommand;
-			if (LC_LOAD_WEAK_DYLIB == BO(plc->cmd))
+			if (m_arrDyLibs[i].bWeak)
 			{
-				dylib_command *dlc = (dylib_command *)pLoadCommand;
-				const char *szDyLib = (const char *)(pLoadCommand + BO(dlc->dylib.name.offset));
-				ZLog::PrintV("\t\t\t%s (weak)\n", szDyLib);
+				ZLog::PrintV("\t\t\t%s (weak)\n", m_arrDyLibs[i].szPath);
 			}
-			pLoadCommand += BO(plc->cmdsize);
 		}
 	}
 
-	if (!m_strInfoPlist.empty())
+	if (m_uInfoPlistLength > 0)
 	{
 		ZLog::Print("\n>>> Embedded Info.plist: \n");
-		ZLog::PrintV("\tlength: \t%lu\n", m_strInfoPlist.size());
+		ZLog::PrintV("\tlength: \t%u\n", m_uInfoPlistLength);
 
-		string strInfoPlist = m_strInfoPlist;
+		string strInfoPlist(m_pInfoPlist, m_uInfoPlistLength);
 		PWriter::StringReplace(strInfoPlist, "\n", "\n\t\t\t");
 		ZLog::PrintV("\tcontent: \t%s\n", strInfoPlist.c_str());
 
-		PrintDataSHASum("\tSHA-1:  \t", E_SHASUM_TYPE_1, m_strInfoPlist);
-		PrintDataSHASum("\tSHA-256:\t", E_SHASUM_TYPE_256, m_strInfoPlist);
+		PrintDataSHASum("\tSHA-1:  \t", E_SHASUM_TYPE_1, (uint8_t *)m_pInfoPlist, m_uInfoPlistLength);
+		PrintDataSHASum("\tSHA-256:\t", E_SHASUM_TYPE_256, (uint8_t *)m_pInfoPlist, m_uInfoPlistLength);
 	}
 
 	if (NULL == m_pSignBase || m_uSignLength <= 0)
@@ -394,12 +750,17 @@ bool ZArchO::BuildCodeSignature(ZSignAsset *pSignAsset, bool bForce, const strin
 	{
 		GetCodeSignatureExistsCodeSlotsData(m_pSignBase, pCodeSlots1Data, uCodeSlots1DataLength, pCodeSlots256Data, uCodeSlots256DataLength);
 	}
+	else if (pSignAsset->m_bIncremental)
+	{ //only the dirty pages will be rehashed
+		GetCodeSignatureReusableCodeSlotsData(m_pSignBase, m_uCodeLength, pCodeSlots1Data, uCodeSlots1DataLength, pCodeSlots256Data, uCodeSlots256DataLength);
+	}
 
 	string strCMSSignatureSlot;
 	string strCodeDirectorySlot;
 	string strAltnateCodeDirectorySlot;
-	SlotBuildCodeDirectory(false, m_pBase, m_uCodeLength, pCodeSlots1Data, uCodeSlots1DataLength, strBundleId, pSignAsset->m_strTeamId, strInfoPlistSHA1, strRequirementsSlotSHA1, strCodeResourcesSHA1, strEntitlementsSlotSHA1, strCodeDirectorySlot);
-	SlotBuildCodeDirectory(true, m_pBase, m_uCodeLength, pCodeSlots256Data, uCodeSlots256DataLength, strBundleId, pSignAsset->m_strTeamId, strInfoPlistSHA256, strRequirementsSlotSHA256, strCodeResourcesSHA256, strEntitlementsSlotSHA256, strAltnateCodeDirectorySlot);
+	SlotBuildCodeDirectories(m_pBase, m_uCodeLength, pCodeSlots1Data, uCodeSlots1DataLength, pCodeSlots256Data, uCodeSlots256DataLength, strBundleId, pSignAsset->m_strTeamId,
+							 strInfoPlistSHA1, strInfoPlistSHA256, strRequirementsSlotSHA1, strRequirementsSlotSHA256, strCodeResourcesSHA1, strCodeResourcesSHA256, strEntitlementsSlotSHA1, strEntitlementsSlotSHA256,
+							 m_setDirtyPages, pSignAsset->m_uThreads, strCodeDirectorySlot, strAltnateCodeDirectorySlot);
 	SlotBuildCMSSignature(pSignAsset, strCodeDirectorySlot, strAltnateCodeDirectorySlot, strCMSSignatureSlot);
 
 	uint32_t uCodeDirectorySlotLength = (uint32_t)strCodeDirectorySlot.size();
@@ -475,25 +836,58 @@ bool ZArchO::BuildCodeSignature(ZSignAsset *pSignAsset, bool bForce, const strin
 	strOutput += strCMSSignatureSlot;
 
 	if (ZLog::IsDebug())
-	{
-		WriteFile("./.zsign_debug/Requirements.slot.new", strRequirementsSlot);
-		WriteFile("./.zsign_debug/Entitlements.slot.new", strEntitlementsSlot);
-		WriteFile("./.zsign_debug/Entitlements.plist.new", strEntitlementsSlot.data() + 8, strEntitlementsSlot.size() - 8);
-		WriteFile("./.zsign_debug/CodeDirectory_SHA1.slot.new", strCodeDirectorySlot);
-		WriteFile("./.zsign_debug/CodeDirectory_SHA256.slot.new", strAltnateCodeDirectorySlot);
-		WriteFile("./.zsign_debug/CMSSignature.slot.new", strCMSSignatureSlot);
-		WriteFile("./.zsign_debug/CMSSignature.der.new", strCMSSignatureSlot.data() + 8, strCMSSignatureSlot.size() - 8);
-		WriteFile("./.zsign_debug/CodeSignature.blob.new", strOutput);
+	{ //slices and nodes are signed in parallel, so every dump is named by file path and arch
+		string strName = (NULL != m_szFile) ? m_szFile : "";
+		StringReplace(strName, "/", "_");
+		StringFormat(strName, "%s.%x_%x", strName.c_str(), BO(m_pHeader->cputype), BO(m_pHeader->cpusubtype));
+		WriteFile(strRequirementsSlot, "./.zsign_debug/%s.Requirements.slot.new", strName.c_str());
+		WriteFile(strEntitlementsSlot, "./.zsign_debug/%s.Entitlements.slot.new", strName.c_str());
+		WriteFile(strEntitlementsSlot.data() + 8, strEntitlementsSlot.size() - 8, "./.zsign_debug/%s.Entitlements.plist.new", strName.c_str());
+		WriteFile(strCodeDirectorySlot, "./.zsign_debug/%s.CodeDirectory_SHA1.slot.new", strName.c_str());
+		WriteFile(strAltnateCodeDirectorySlot, "./.zsign_debug/%s.CodeDirectory_SHA256.slot.new", strName.c_str());
+		WriteFile(strCMSSignatureSlot, "./.zsign_debug/%s.CMSSignature.slot.new", strName.c_str());
+		WriteFile(strCMSSignatureSlot.data() + 8, strCMSSignatureSlot.size() - 8, "./.zsign_debug/%s.CMSSignature.der.new", strName.c_str());
+		WriteFile(strOutput, "./.zsign_debug/%s.CodeSignature.blob.new", strName.c_str());
 	}
 
 	return true;
 }
 
+uint32_t ZArchO::GetCodeSignatureSpace(ZSignAsset *pSignAsset, const string &strBundleId)
+{
+	//same blobs as BuildCodeSignature, without hashing or signing anything
+	string strRequirementsSlot;
+	string strEntitlementsSlot;
+	SlotBuildRequirements(strBundleId, pSignAsset->m_strSubjectCN, strRequirementsSlot);
+	SlotBuildEntitlements(IsExecute() ? pSignAsset->m_strEntitlementsData : "", strEntitlementsSlot);
+
+	vector<uint32_t> arrSlotLengths;
+	arrSlotLengths.push_back(GetCodeDirectorySlotLength(false, m_uCodeLength, strBundleId, pSignAsset->m_strTeamId));
+	arrSlotLengths.push_back((uint32_t)strRequirementsSlot.size());
+	arrSlotLengths.push_back((uint32_t)strEntitlementsSlot.size());
+	arrSlotLengths.push_back(GetCodeDirectorySlotLength(true, m_uCodeLength, strBundleId, pSignAsset->m_strTeamId));
+	arrSlotLengths.push_back(GetCMSSignatureSlotLimit(pSignAsset));
+
+	uint32_t uCodeSignLength = sizeof(CS_SuperBlob);
+	for (size_t i = 0; i < arrSlotLengths.size(); i++)
+	{
+		if (arrSlotLengths[i] > 0)
+		{
+			uCodeSignLength += sizeof(CS_BlobIndex) + arrSlotLengths[i];
+		}
+	}
+	return uCodeSignLength;
+}
+
+bool ZArchO::IsEnoughSpace(uint32_t uSignLength)
+{
+	return (NULL != m_pSignBase && m_uLength >= m_uCodeLength && m_uLength - m_uCodeLength >= uSignLength);
+}
+
 bool ZArchO::Sign(ZSignAsset *pSignAsset, bool bForce, const string &strBundleId, const string &strInfoPlistSHA1, const string &strInfoPlistSHA256, const string &strCodeResourcesData)
 {
 	if (NULL == m_pSignBase)
 	{
-		m_bEnoughSpace = false;
 		ZLog::Warn(">>> Can't Find CodeSignature Segment!\n");
 		return false;
 	}
@@ -521,143 +915,77 @@ bool ZArchO::Sign(ZSignAsset *pSignAsset, bool bForce, const string &strBundleId
 	int nSpaceLength = (int)m_uLength - (int)m_uCodeLength - (int)strCodeSignBlob.size();
 	if (nSpaceLength < 0)
 	{
-		m_bEnoughSpace = false;
+		m_uSignLengthNeeded = (uint32_t)strCodeSignBlob.size();
 		ZLog::WarnV(">>> No Enough CodeSignature Space! Length => Now: %d, Need: %d\n", (int)m_uLength - (int)m_uCodeLength, (int)strCodeSignBlob.size());
 		return false;
 	}
 
 	memcpy(m_pBase + m_uCodeLength, strCodeSignBlob.data(), strCodeSignBlob.size());
+	MarkDirty(m_uCodeLength, (uint32_t)strCodeSignBlob.size());
 	//memset(m_pBase + m_uCodeLength + strCodeSignBlob.size(), 0, nSpaceLength);
 	return true;
 }
 
-uint32_t ZArchO::ReallocCodeSignSpace(const string &strNewFile)
+uint32_t ZArchO::ReallocCodeSignSpace(uint32_t uSignLength)
 {
-	RemoveFile(strNewFile.c_str());
-
-	uint32_t uNewLength = m_uCodeLength + ByteAlign(((m_uCodeLength / 4096) + 1) * (20 + 32), 4096) + 16384; //16K May Be Enough
-	if (NULL == m_pLinkEditSegment || uNewLength <= m_uLength)
-	{
-		return 0;
-	}
-
-	load_command *pseglc = (load_command *)m_pLinkEditSegment;
-	switch (BO(pseglc->cmd))
-	{
-	case LC_SEGMENT:
-	{
-		segment_command *seglc = (segment_command *)m_pLinkEditSegment;
-		seglc->vmsize = ByteAlign(BO(seglc->vmsize) + (uNewLength - m_uLength), 4096);
-		seglc->vmsize = BO(seglc->vmsize);
-		seglc->filesize = uNewLength - BO(seglc->fileoff);
-		seglc->filesize = BO(seglc->filesize);
-	}
-	break;
-	case LC_SEGMENT_64:
-	{
-		segment_command_64 *seglc = (segment_command_64 *)m_pLinkEditSegment;
-		seglc->vmsize = ByteAlign(BO(seglc->vmsize) + (uNewLength - m_uLength), 4096);
-		seglc->vmsize = BO(seglc->vmsize);
-		seglc->filesize = uNewLength - BO(seglc->fileoff);
-		seglc->filesize = BO(seglc->filesize);
-	}
-	break;
-	}
-
-	codesignature_command *pcslc = (codesignature_command *)m_pCodeSignSegment;
-	if (NULL == pcslc)
-	{
-		if (m_uLoadCommandsFreeSpace < 4)
-		{
-			ZLog::Error(">>> Can't Find Free Space Of LoadCommands For CodeSignature!\n");
-			return 0;
-		}
-
-		pcslc = (codesignature_command *)(m_pBase + m_uHeaderSize + BO(m_pHeader->sizeofcmds));
-		pcslc->cmd = BO(LC_CODE_SIGNATURE);
-		pcslc->cmdsize = BO((uint32_t)sizeof(codesignature_command));
-		pcslc->dataoff = BO(m_uCodeLength);
-		m_pHeader->ncmds = BO(BO(m_pHeader->ncmds) + 1);
-		m_pHeader->sizeofcmds = BO(BO(m_pHeader->sizeofcmds) + sizeof(codesignature_command));
+	//only the load commands are patched here, the caller moves the slice and grows the file
+	if (IsEnoughSpace(uSignLength))
+	{ //another slice of a fat file needs more space, keep this one as it is
+		return m_uLength;
 	}
-	pcslc->datasize = BO(uNewLength - m_uCodeLength);
 
-	if (!AppendFile(strNewFile.c_str(), (const char *)m_pBase, m_uLength))
+	uint32_t uNewLength = m_uCodeLength + ByteAlign(uSignLength, 16);
+	if (NULL == m_pLinkEditSegment || uNewLength <= m_uLength)
 	{
 		return 0;
 	}
 
-	string strPadding;
-	strPadding.append(uNewLength - m_uLength, 0);
-	if (!AppendFile(strNewFile.c_str(), strPadding))
+	if (!m_pParser->ResizeCodeSignature(this, uNewLength))
 	{
-		RemoveFile(strNewFile.c_str());
 		return 0;
 	}
-
 	return uNewLength;
 }
 
-bool ZArchO::InjectDyLib(bool bWeakInject, const char *szDyLibPath, bool &bCreate)
+bool ZArchO::PlanLoadCommands(const vector<ZLoadCommandEdit> &arrEdits, string &strCommands, uint32_t &uCommandCount)
 {
-	if (NULL == m_pHeader)
+	if (NULL == m_pHeader || NULL == m_pParser)
 	{
 		return false;
 	}
+	return m_pParser->PlanLoadCommands(this, arrEdits, strCommands, uCommandCount);
+}
 
-	uint8_t *pLoadCommand = m_pBase + m_uHeaderSize;
-	for (uint32_t i = 0; i < BO(m_pHeader->ncmds); i++)
-	{
-		load_command *plc = (load_command *)pLoadCommand;
-		uint32_t uLoadType = BO(plc->cmd);
-		if (LC_LOAD_DYLIB == uLoadType || LC_LOAD_WEAK_DYLIB == uLoadType)
-		{
-			dylib_command *dlc = (dylib_command *)pLoadCommand;
-			const char *szDyLib = (const char *)(pLoadCommand + BO(dlc->dylib.name.offset));
-			if (0 == strcmp(szDyLib, szDyLibPath))
-			{	
-				if((bWeakInject && (LC_LOAD_WEAK_DYLIB != uLoadType)) || (!bWeakInject && (LC_LOAD_DYLIB != uLoadType)))
-				{
-					dlc->cmd = BO((uint32_t)(bWeakInject ? LC_LOAD_WEAK_DYLIB : LC_LOAD_DYLIB));
-					ZLog::WarnV(">>> DyLib Load Type Changed! %s -> %s\n", (LC_LOAD_DYLIB == uLoadType) ? "LC_LOAD_DYLIB" : "LC_LOAD_WEAK_DYLIB", bWeakInject ? "LC_LOAD_WEAK_DYLIB" : "LC_LOAD_DYLIB");
-				}
-				else
-				{
-					ZLog::WarnV(">>> DyLib Is Already Existed! %s\n");
-				}
-				return true;
-			}
-		}
-		pLoadCommand += BO(plc->cmdsize);
-	}
-
-	uint32_t uDylibPathLength = strlen(szDyLibPath);
-	uint32_t uDylibPathPadding = (8 - uDylibPathLength % 8);
-	uint32_t uDyLibCommandSize = sizeof(dylib_command) + uDylibPathLength + uDylibPathPadding;
-	if (m_uLoadCommandsFreeSpace < uDyLibCommandSize)
+bool ZArchO::ApplyLoadCommands(const string &strCommands, uint32_t uCommandCount, bool &bChanged)
+{
+	if (NULL == m_pHeader || NULL == m_pParser)
 	{
-		ZLog::Error(">>> Can't Find Free Space Of LoadCommands For LC_LOAD_DYLIB Or LC_LOAD_WEAK_DYLIB!\n");
 		return false;
 	}
+	return m_pParser->ApplyLoadCommands(this, strCommands, uCommandCount, bChanged);
+}
 
-	//add
-	dylib_command *dlc = (dylib_command *)(m_pBase + m_uHeaderSize + BO(m_pHeader->sizeofcmds));
-	dlc->cmd = BO((uint32_t)(bWeakInject ? LC_LOAD_WEAK_DYLIB : LC_LOAD_DYLIB));
-	dlc->cmdsize = BO(uDyLibCommandSize);
-	dlc->dylib.name.offset = BO((uint32_t)sizeof(dylib_command));
-	dlc->dylib.timestamp = BO((uint32_t)2);
-	dlc->dylib.current_version = 0;
-	dlc->dylib.compatibility_version = 0;
-
-	string strDylibPath = szDyLibPath;
-	strDylibPath.append(uDylibPathPadding, 0);
+ZLoadCommand *ZArchO::FindLoadCommand(uint32_t uCmd)
+{
+	unordered_map<uint32_t, uint32_t>::iterator it = m_mapLoadCommands.find(uCmd);
+	return (it != m_mapLoadCommands.end()) ? &m_arrLoadCommands[it->second] : NULL;
+}
 
-	uint8_t *pDyLibPath = (uint8_t *)dlc + sizeof(dylib_command);
-	memcpy(pDyLibPath, strDylibPath.data(), uDylibPathLength + uDylibPathPadding);
+ZDyLib *ZArchO::FindDyLib(const char *szDyLibPath)
+{
+	unordered_map<string, uint32_t>::iterator it = m_mapDyLibs.find(szDyLibPath);
+	return (it != m_mapDyLibs.end()) ? &m_arrDyLibs[it->second] : NULL;
+}
 
-	m_pHeader->ncmds = BO(BO(m_pHeader->ncmds) + 1);
-	m_pHeader->sizeofcmds = BO(BO(m_pHeader->sizeofcmds) + uDyLibCommandSize);
+void ZArchO::MarkDirty(uint32_t uOffset, uint32_t uLength)
+{
+	if (uLength <= 0)
+	{
+		return;
+	}
 
-	bCreate = true;
-	return true;
+	for (uint32_t i = uOffset / CODE_PAGE_SIZE; i <= (uOffset + uLength - 1) / CODE_PAGE_SIZE; i++)
+	{
+		m_setDirtyPages.insert(i);
+	}
 }
@@ -2,6 +2,36 @@
 #include "common/mach-o.h"
 #include "openssl.h"
 
+struct ZArchOParser;
+
+struct ZLoadCommand
+{
+	uint32_t uCmd;
+	uint32_t uOffset;
+	uint32_t uSize;
+};
+
+enum
+{
+	E_LOAD_COMMAND_INJECT = 0, //add a dylib, or switch an existing one between weak and strong
+	E_LOAD_COMMAND_REMOVE = 1, //drop a dylib, the ordinals of the dylibs after it shift, so only remove ones nothing binds to
+	E_LOAD_COMMAND_RPATH = 2,
+};
+
+struct ZLoadCommandEdit
+{
+	uint32_t uType; //E_LOAD_COMMAND_*
+	string strPath;
+	bool bWeak;
+};
+
+struct ZDyLib
+{
+	uint32_t uCommand; //index in m_arrLoadCommands
+	const char *szPath;
+	bool bWeak;
+};
+
 class ZArchO
 {
 public:
@@ -12,8 +42,16 @@ public:
 	bool Sign(ZSignAsset *pSignAsset, bool bForce, const string &strBundleId, const string &strInfoPlistSHA1, const string &strInfoPlistSHA256, const string &strCodeResourcesData);
 	void PrintInfo();
 	bool IsExecute();
-	bool InjectDyLib(bool bWeakInject, const char *szDyLibPath, bool &bCreate);
-	uint32_t ReallocCodeSignSpace(const string &strNewFile);
+	const char *GetArchName();
+	bool PlanLoadCommands(const vector<ZLoadCommandEdit> &arrEdits, string &strCommands, uint32_t &uCommandCount);
+	bool ApplyLoadCommands(const string &strCommands, uint32_t uCommandCount, bool &bChanged);
+	bool IndexLoadCommands();
+	uint32_t GetCodeSignatureSpace(ZSignAsset *pSignAsset, const string &strBundleId);
+	bool IsEnoughSpace(uint32_t uSignLength);
+	uint32_t ReallocCodeSignSpace(uint32_t uSignLength);
+	void MarkDirty(uint32_t uOffset, uint32_t uLength);
+	ZLoadCommand *FindLoadCommand(uint32_t uCmd);
+	ZDyLib *FindDyLib(const char *szDyLibPath);
 
 private:
 	uint32_t BO(uint32_t uVal);
@@ -27,14 +65,24 @@ public:
 	uint32_t m_uCodeLength;
 	uint8_t *m_pSignBase;
 	uint32_t m_uSignLength;
-	string m_strInfoPlist;
+	const char *m_pInfoPlist; //points into the mapping, valid until the file is closed
+	uint32_t m_uInfoPlistLength;
 	bool m_bEncrypted;
 	bool m_b64;
 	bool m_bBigEndian;
-	bool m_bEnoughSpace;
+	uint32_t m_uSignLengthNeeded; //size of a signature that didn't fit the planned space, 0 otherwise
+	uint8_t *m_pTextSegment;
 	uint8_t *m_pCodeSignSegment;
 	uint8_t *m_pLinkEditSegment;
+	uint8_t *m_pEncryptionInfo;
 	uint32_t m_uLoadCommandsFreeSpace;
 	mach_header *m_pHeader;
 	uint32_t m_uHeaderSize;
+	set<uint32_t> m_setDirtyPages;
+	const ZArchOParser *m_pParser;
+	const char *m_szFile; //path of the file holding this slice, names the debug output
+	vector<ZLoadCommand> m_arrLoadCommands;
+	vector<ZDyLib> m_arrDyLibs;
+	unordered_map<uint32_t, uint32_t> m_mapLoadCommands; //cmd => first load command of that type
+	unordered_map<string, uint32_t> m_mapDyLibs;		   //path => first dylib with that path
 };
\ No newline at end of file
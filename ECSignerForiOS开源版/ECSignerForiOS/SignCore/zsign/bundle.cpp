@@ -5,46 +5,48 @@
 #include "common/base64.h"
 #include "common/common.h"
 #include "MyCPPClass.hpp"
+#include <algorithm>
+#include <thread>
+#include <condition_variable>
 
 ZAppBundle::ZAppBundle()
 {
 	m_pSignAsset = NULL;
 	m_bForceSign = false;
 	m_bWeakInject = false;
+	m_uDigestHits = 0;
 }
 
 
 
 bool ZAppBundle::FindAppFolder(const string &strFolder, string &strAppFolder)
 {
-	if (IsPathSuffix(strFolder, ".app"))
+	if (!m_fileTree.Scan(strFolder))
 	{
-		strAppFolder = strFolder;
+		return false;
+	}
+	return FindAppFolder(0, strAppFolder);
+}
+
+bool ZAppBundle::FindAppFolder(uint32_t uFolder, string &strAppFolder)
+{
+	const ZFileEntry &folder = m_fileTree.GetEntry(uFolder);
+	if (E_BUNDLE_APP == folder.uBundleKind)
+	{
+		strAppFolder = m_fileTree.GetPath(uFolder);
 		return true;
 	}
 
-	DIR *dir = opendir(strFolder.c_str());
-	if (NULL != dir)
+	for (uint32_t uChild = folder.uFirstChild; FILE_TREE_NONE != uChild; uChild = m_fileTree.GetEntry(uChild).uNextSibling)
 	{
-		dirent *ptr = readdir(dir);
-		while (NULL != ptr)
+		const ZFileEntry &entry = m_fileTree.GetEntry(uChild);
+		if (DT_DIR == entry.uType && "__MACOSX" != entry.strName)
 		{
-			if (0 != strcmp(ptr->d_name, ".") && 0 != strcmp(ptr->d_name, "..") && 0 != strcmp(ptr->d_name, "__MACOSX"))
+			if (FindAppFolder(uChild, strAppFolder))
 			{
-				if (DT_DIR == ptr->d_type)
-				{
-					string strSubFolder = strFolder;
-					strSubFolder += "/";
-					strSubFolder += ptr->d_name;
-					if (FindAppFolder(strSubFolder, strAppFolder))
-					{
-						return true;
-					}
-				}
+				return true;
 			}
-			ptr = readdir(dir);
 		}
-		closedir(dir);
 	}
 	return false;
 }
@@ -88,103 +90,133 @@ bool ZAppBundle::GetSignFolderInfo(const string &strFolder, JValue &jvNode, bool
 
 bool ZAppBundle::GetObjectsToSign(const string &strFolder, JValue &jvInfo)
 {
-	DIR *dir = opendir(strFolder.c_str());
-	if (NULL != dir)
+	uint32_t uFolder = m_fileTree.Find(strFolder);
+	if (FILE_TREE_NONE == uFolder)
+	{
+		return true;
+	}
+
+	for (uint32_t uChild = m_fileTree.GetEntry(uFolder).uFirstChild; FILE_TREE_NONE != uChild; uChild = m_fileTree.GetEntry(uChild).uNextSibling)
 	{
-		dirent *ptr = readdir(dir);
-		while (NULL != ptr)
+		const ZFileEntry &entry = m_fileTree.GetEntry(uChild);
+		string strNode = strFolder + "/" + entry.strName;
+		if (DT_DIR == entry.uType)
 		{
-			if (0 != strcmp(ptr->d_name, ".") && 0 != strcmp(ptr->d_name, ".."))
+			if (E_BUNDLE_NONE != entry.uBundleKind)
 			{
-				string strNode = strFolder + "/" + ptr->d_name;
-				if (DT_DIR == ptr->d_type)
+				JValue jvNode;
+				jvNode["path"] = strNode.substr(m_strAppFolder.size() + 1);
+				if (!GetSignFolderInfo(strNode, jvNode))
 				{
-					if (IsPathSuffix(strNode, ".app") || IsPathSuffix(strNode, ".appex") || IsPathSuffix(strNode, ".framework") || IsPathSuffix(strNode, ".xctest"))
-					{
-						JValue jvNode;
-						jvNode["path"] = strNode.substr(m_strAppFolder.size() + 1);
-						if (!GetSignFolderInfo(strNode, jvNode))
-						{
-							return false;
-						}
-						if (!GetObjectsToSign(strNode, jvNode))
-						{
-							return false;
-						}
-						jvInfo["folders"].push_back(jvNode);
-					}
-					else
-					{
-						GetObjectsToSign(strNode, jvInfo);
-					}
+					return false;
 				}
-				else if (DT_REG == ptr->d_type)
+				if (!GetObjectsToSign(strNode, jvNode))
 				{
-					if (IsPathSuffix(strNode, ".dylib"))
-					{
-						jvInfo["files"].push_back(strNode.substr(m_strAppFolder.size() + 1));
-					}
+					return false;
 				}
+				jvInfo["folders"].push_back(jvNode);
+			}
+			else
+			{
+				GetObjectsToSign(strNode, jvInfo);
+			}
+		}
+		else if (DT_REG == entry.uType)
+		{
+			if (IsPathSuffix(strNode, ".dylib"))
+			{
+				jvInfo["files"].push_back(strNode.substr(m_strAppFolder.size() + 1));
 			}
-			ptr = readdir(dir);
 		}
-		closedir(dir);
 	}
 	return true;
 }
 
-void ZAppBundle::GetFolderFiles(const string &strFolder, const string &strBaseFolder, set<string> &setFiles)
+void ZAppBundle::GetFolderFiles(const string &strFolder, map<string, int64_t> &mapFiles)
 {
-	DIR *dir = opendir(strFolder.c_str());
-	if (NULL != dir)
+	uint32_t uFolder = m_fileTree.Find(strFolder);
+	if (FILE_TREE_NONE != uFolder)
 	{
-		dirent *ptr = readdir(dir);
-		while (NULL != ptr)
+		m_fileTree.GetFiles(uFolder, mapFiles);
+	}
+}
+
+bool ZAppBundle::GetFileSHASumBase64(const string &strFile, string &strSHA1Base64, string &strSHA256Base64)
+{
+	{ //nested bundles are sealed again by every parent, hash each file once per run
+		lock_guard<mutex> lock(m_mutexDigests);
+		map<string, pair<string, string> >::iterator it = m_mapDigests.find(strFile);
+		if (it != m_mapDigests.end())
 		{
-			if (0 != strcmp(ptr->d_name, ".") && 0 != strcmp(ptr->d_name, ".."))
-			{
-				string strNode = strFolder;
-				strNode += "/";
-				strNode += ptr->d_name;
-				if (DT_DIR == ptr->d_type)
-				{
-					GetFolderFiles(strNode, strBaseFolder, setFiles);
-				}
-				else if (DT_REG == ptr->d_type)
-				{
-					setFiles.insert(strNode.substr(strBaseFolder.size() + 1));
-				}
-			}
-			ptr = readdir(dir);
+			strSHA1Base64 = it->second.first;
+			strSHA256Base64 = it->second.second;
+			m_uDigestHits++;
+			return true;
 		}
-		closedir(dir);
 	}
+
+	if (!m_fileHashCache.SHASumBase64File(strFile.c_str(), strSHA1Base64, strSHA256Base64))
+	{
+		return false;
+	}
+
+	lock_guard<mutex> lock(m_mutexDigests);
+	m_mapDigests[strFile] = make_pair(strSHA1Base64, strSHA256Base64);
+	return true;
+}
+
+void ZAppBundle::RemoveFileSHASumBase64(const string &strFile)
+{
+	lock_guard<mutex> lock(m_mutexDigests);
+	m_mapDigests.erase(strFile);
 }
 
 bool ZAppBundle::GenerateCodeResources(const string &strFolder, JValue &jvCodeRes)
 {
 	jvCodeRes.clear();
 
-	set<string> setFiles;
-	GetFolderFiles(strFolder, strFolder, setFiles);
+	map<string, int64_t> mapFiles;
+	GetFolderFiles(strFolder, mapFiles);
 
 	JValue jvInfo;
 	string strInfoPlistPath = strFolder + "/Info.plist";
 	jvInfo.readPListFile(strInfoPlistPath.c_str());
 	string strBundleExe = jvInfo["CFBundleExecutable"];
-	setFiles.erase(strBundleExe);
-	setFiles.erase("_CodeSignature/CodeResources");
+	mapFiles.erase(strBundleExe);
+	mapFiles.erase("_CodeSignature/CodeResources");
 
 	jvCodeRes["files"] = JValue(JValue::E_OBJECT);
 	jvCodeRes["files2"] = JValue(JValue::E_OBJECT);
 
-	for (set<string>::iterator it = setFiles.begin(); it != setFiles.end(); it++)
+	//hash on the pool, largest files first
+	vector<string> arrFiles;
+	vector<int64_t> arrSizes;
+	for (map<string, int64_t>::iterator it = mapFiles.begin(); it != mapFiles.end(); it++)
 	{
-		string strKey = *it;
-		string strFile = strFolder + "/" + strKey;
-		string strFileSHA1Base64;
-		string strFileSHA256Base64;
-		SHASumBase64File(strFile.c_str(), strFileSHA1Base64, strFileSHA256Base64);
+		arrFiles.push_back(it->first);
+		arrSizes.push_back(it->second);
+	}
+	vector<string> arrSHA1Base64(arrFiles.size());
+	vector<string> arrSHA256Base64(arrFiles.size());
+	vector<uint32_t> arrOrder(arrFiles.size());
+	for (uint32_t i = 0; i < arrFiles.size(); i++)
+	{
+		arrOrder[i] = i;
+	}
+	stable_sort(arrOrder.begin(), arrOrder.end(), [&](uint32_t a, uint32_t b) { return arrSizes[a] > arrSizes[b]; });
+
+	ZThreadPool pool(m_pSignAsset->m_uThreads);
+	pool.Run(arrOrder, [&](uint32_t uIndex) {
+		string strFile = strFolder + "/" + arrFiles[uIndex];
+		GetFileSHASumBase64(strFile, arrSHA1Base64[uIndex], arrSHA256Base64[uIndex]);
+	});
+
+	//merge in key order, the output does not depend on scheduling
+	for (uint32_t i = 0; i < arrFiles.size(); i++)
+	{
+		const string &strKey = arrFiles[i];
+		const string &strFileSHA1Base64 = arrSHA1Base64[i];
+		const string &strFileSHA256Base64 = arrSHA256Base64[i];
 
 		bool bomit1 = false;
 		bool bomit2 = false;
@@ -302,16 +334,22 @@ void ZAppBundle::GetNodeChangedFiles(JValue &jvNode)
 	}
 }
 
-bool ZAppBundle::SignNode(JValue &jvNode)
+void ZAppBundle::AddSignTasks(JValue &jvNode, uint32_t uParent, vector<ZSignTask> &arrTasks)
 {
+	uint32_t uIndex = (uint32_t)arrTasks.size();
+	ZSignTask task;
+	task.pNode = &jvNode;
+	task.uParent = uParent;
+	task.uPending = 0;
+	task.uTime = 0;
+	arrTasks.push_back(task);
+
 	if (jvNode.has("folders"))
 	{
 		for (size_t i = 0; i < jvNode["folders"].size(); i++)
 		{
-			if (!SignNode(jvNode["folders"][i]))
-			{
-				return false;
-			}
+			arrTasks[uIndex].uPending++;
+			AddSignTasks(jvNode["folders"][i], uIndex, arrTasks);
 		}
 	}
 
@@ -319,20 +357,133 @@ bool ZAppBundle::SignNode(JValue &jvNode)
 	{
 		for (size_t i = 0; i < jvNode["files"].size(); i++)
 		{
-			const char *szFile = jvNode["files"][i].asCString();
-			ZLog::PrintV(">>> SignFile: \t%s\n", szFile);
-			ZMachO macho;
-			if (!macho.InitV("%s/%s", m_strAppFolder.c_str(), szFile))
+			ZSignTask file;
+			file.pNode = &jvNode;
+			file.strFile = jvNode["files"][i].asString();
+			file.uParent = uIndex;
+			file.uPending = 0;
+			file.uTime = 0;
+			arrTasks[uIndex].uPending++;
+			arrTasks.push_back(file);
+		}
+	}
+}
+
+bool ZAppBundle::SignNodes(JValue &jvRoot)
+{
+	//a bundle only depends on the bundles and dylibs inside it, siblings are signed concurrently
+	vector<ZSignTask> arrTasks;
+	AddSignTasks(jvRoot, SIGN_TASK_NONE, arrTasks);
+
+	vector<uint32_t> arrReady;
+	for (size_t i = arrTasks.size(); i > 0; i--)
+	{
+		if (0 == arrTasks[i - 1].uPending)
+		{
+			arrReady.push_back((uint32_t)(i - 1));
+		}
+	}
+
+	mutex mutexTasks;
+	condition_variable cvTasks;
+	bool bFailed = false;
+	uint32_t uDone = 0;
+	uint64_t uBeginTime = GetMicroSecond();
+	auto fnWork = [&](bool bBudget) {
+		unique_lock<mutex> lock(mutexTasks);
+		while (true)
+		{
+			if (bBudget && arrReady.empty() && !bFailed && uDone < arrTasks.size())
+			{ //an idle worker lends its thread to the nodes that are running, it may not get it back
+				ZThreadBudget::Release(1);
+				cvTasks.wait(lock, [&]() { return bFailed || uDone >= arrTasks.size() || !arrReady.empty(); });
+				if (bFailed || uDone >= arrTasks.size() || 0 == ZThreadBudget::Acquire(1))
+				{
+					return;
+				}
+			}
+			cvTasks.wait(lock, [&]() { return bFailed || uDone >= arrTasks.size() || !arrReady.empty(); });
+			if (bFailed || uDone >= arrTasks.size())
 			{
-				return false;
+				break;
+			}
+
+			//the ready list is a stack, so a parent runs right after its last child
+			uint32_t uIndex = arrReady.back();
+			arrReady.pop_back();
+			ZSignTask &task = arrTasks[uIndex];
+			lock.unlock();
+
+			uint64_t uTaskTime = GetMicroSecond();
+			bool bRet = task.strFile.empty() ? SignNode(*task.pNode) : SignFile(task.strFile);
+			task.uTime = GetMicroSecond() - uTaskTime;
+			ZLog::DebugV(">>> SignTime: \t%s, %llu ms\n", task.strFile.empty() ? (*task.pNode)["path"].asCString() : task.strFile.c_str(), (unsigned long long)(task.uTime / 1000));
+
+			lock.lock();
+			uDone++;
+			if (!bRet)
+			{
+				bFailed = true;
 			}
-			if (!macho.Sign(m_pSignAsset, m_bForceSign, "", "", "", ""))
+			else if (SIGN_TASK_NONE != task.uParent && 0 == --arrTasks[task.uParent].uPending)
 			{
-				return false;
+				arrReady.push_back(task.uParent);
 			}
+			cvTasks.notify_all();
 		}
+		if (bBudget)
+		{
+			ZThreadBudget::Release(1);
+		}
+	};
+
+	//the workers share the thread budget with the slices and pages they sign
+	uint32_t uThreads = GetThreadCount(m_pSignAsset->m_uThreads);
+	if (uThreads > arrTasks.size())
+	{
+		uThreads = (uint32_t)arrTasks.size();
+	}
+	uThreads = 1 + ((uThreads > 1) ? ZThreadBudget::Acquire(uThreads - 1) : 0);
+
+	vector<thread> arrWorkers;
+	for (uint32_t i = 1; i < uThreads; i++)
+	{
+		arrWorkers.push_back(thread(fnWork, true));
+	}
+	fnWork(false);
+	for (size_t i = 0; i < arrWorkers.size(); i++)
+	{
+		arrWorkers[i].join();
+	}
+
+	uint64_t uWorkTime = 0;
+	for (size_t i = 0; i < arrTasks.size(); i++)
+	{
+		uWorkTime += arrTasks[i].uTime;
+	}
+	ZLog::PrintV(">>> SignNodes: \t%u nodes, %u threads, %llu ms (%llu ms of work)\n", (uint32_t)arrTasks.size(), uThreads, (unsigned long long)((GetMicroSecond() - uBeginTime) / 1000), (unsigned long long)(uWorkTime / 1000));
+	return !bFailed;
+}
+
+bool ZAppBundle::SignFile(const string &strFile)
+{
+	ZLog::PrintV(">>> SignFile: \t%s\n", strFile.c_str());
+	ZMachO macho;
+	if (!macho.InitV("%s/%s", m_strAppFolder.c_str(), strFile.c_str()))
+	{
+		return false;
 	}
+	RemoveFileSHASumBase64(m_strAppFolder + "/" + strFile);
+	if (!macho.Sign(m_pSignAsset, m_bForceSign, "", "", "", ""))
+	{
+		return false;
+	}
+	m_fileTree.Update(m_strAppFolder + "/" + strFile);
+	return true;
+}
 
+bool ZAppBundle::SignNode(JValue &jvNode)
+{
 	ZBase64 b64;
 	string strInfoPlistSHA1;
 	string strInfoPlistSHA256;
@@ -364,6 +515,27 @@ bool ZAppBundle::SignNode(JValue &jvNode)
 		return false;
 	}
 
+	if ("/" == strFolder && !m_arrDyLibPaths.empty())
+	{ //one edit of the load commands for all dylibs, the pages it touches are rehashed by the sign below
+		vector<ZLoadCommandEdit> arrEdits;
+		for (size_t i = 0; i < m_arrDyLibPaths.size(); i++)
+		{
+			ZLoadCommandEdit edit;
+			edit.uType = E_LOAD_COMMAND_INJECT;
+			edit.strPath = m_arrDyLibPaths[i];
+			edit.bWeak = m_bWeakInject;
+			arrEdits.push_back(edit);
+			ZLog::PrintV(">>> Inject DyLib: %s%s\n", edit.strPath.c_str(), edit.bWeak ? " (weak)" : "");
+		}
+
+		bool bChanged = false;
+		if (!macho.EditLoadCommands(arrEdits, bChanged))
+		{
+			ZLog::ErrorV(">>> Can't Inject DyLibs! %s\n", strExePath.c_str());
+			return false;
+		}
+	}
+
 	CreateFolderV("%s/_CodeSignature", strBaseFolder.c_str());
 	string strCodeResFile = strBaseFolder + "/_CodeSignature/CodeResources";
 
@@ -390,7 +562,7 @@ bool ZAppBundle::SignNode(JValue &jvNode)
 
 			string strFileSHA1Base64;
 			string strFileSHA256Base64;
-			if (!SHASumBase64File(strRealFile.c_str(), strFileSHA1Base64, strFileSHA256Base64))
+			if (!GetFileSHASumBase64(strRealFile, strFileSHA1Base64, strFileSHA256Base64))
 			{
 				ZLog::ErrorV(">>> Can't Get Changed File SHASumBase64! %s", strFile.c_str());
 				return false;
@@ -411,51 +583,50 @@ bool ZAppBundle::SignNode(JValue &jvNode)
 
 	string strCodeResData;
 	jvCodeRes.writePList(strCodeResData);
+	RemoveFileSHASumBase64(strCodeResFile);
 	if (!WriteFile(strCodeResFile.c_str(), strCodeResData))
 	{
 		ZLog::ErrorV("\tWriting CodeResources Failed! %s\n", strCodeResFile.c_str());
 		return false;
 	}
+	m_fileTree.Update(strCodeResFile);
 
 	bool bForceSign = m_bForceSign;
    
+	RemoveFileSHASumBase64(strExePath);
 	if (!macho.Sign(m_pSignAsset, bForceSign, strBundleId, strInfoPlistSHA1, strInfoPlistSHA256, strCodeResData))
 	{
 		return false;
 	}
+	m_fileTree.Update(strExePath);
 
 	return true;
 }
 
 void ZAppBundle::GetPlugIns(const string &strFolder, vector<string> &arrPlugIns)
 {
-	DIR *dir = opendir(strFolder.c_str());
-	if (NULL != dir)
+	uint32_t uFolder = m_fileTree.Find(strFolder);
+	if (FILE_TREE_NONE == uFolder)
+	{
+		return;
+	}
+
+	for (uint32_t uChild = m_fileTree.GetEntry(uFolder).uFirstChild; FILE_TREE_NONE != uChild; uChild = m_fileTree.GetEntry(uChild).uNextSibling)
 	{
-		dirent *ptr = readdir(dir);
-		while (NULL != ptr)
+		const ZFileEntry &entry = m_fileTree.GetEntry(uChild);
+		if (DT_DIR == entry.uType)
 		{
-			if (0 != strcmp(ptr->d_name, ".") && 0 != strcmp(ptr->d_name, ".."))
+			string strSubFolder = strFolder + "/" + entry.strName;
+			if (E_BUNDLE_APP == entry.uBundleKind || E_BUNDLE_APPEX == entry.uBundleKind)
 			{
-				if (DT_DIR == ptr->d_type)
-				{
-					string strSubFolder = strFolder;
-					strSubFolder += "/";
-					strSubFolder += ptr->d_name;
-					if (IsPathSuffix(strSubFolder, ".app") || IsPathSuffix(strSubFolder, ".appex"))
-					{
-						arrPlugIns.push_back(strSubFolder);
-					}
-					GetPlugIns(strSubFolder, arrPlugIns);
-				}
+				arrPlugIns.push_back(strSubFolder);
 			}
-			ptr = readdir(dir);
+			GetPlugIns(strSubFolder, arrPlugIns);
 		}
-		closedir(dir);
 	}
 }
 
-bool ZAppBundle::SignFolder(ZSignAsset *pSignAsset, const string &strFolder, const string &strBundleVersion, const string &strBundleID, const string &strDisplayName, bool bForce, bool bWeakInject, bool bEnableCache)
+bool ZAppBundle::SignFolder(ZSignAsset *pSignAsset, const string &strFolder, const string &strBundleVersion, const string &strBundleID, const string &strDisplayName, const vector<string> &arrDyLibFiles, bool bForce, bool bWeakInject, bool bEnableCache)
 {
 	m_bForceSign = bForce;
 	m_pSignAsset = pSignAsset;
@@ -523,6 +694,7 @@ bool ZAppBundle::SignFolder(ZSignAsset *pSignAsset, const string &strFolder, con
 						}
 
 						jvPlugInInfoPlist.writePListPath("%s/Info.plist", strPlugin.c_str());
+						m_fileTree.Update(strPlugin + "/Info.plist");
 					}
 				}
 			}
@@ -541,6 +713,7 @@ bool ZAppBundle::SignFolder(ZSignAsset *pSignAsset, const string &strFolder, con
             }
 
 			jvInfoPlist.writePListPath("%s/Info.plist", m_strAppFolder.c_str());
+			m_fileTree.Update(m_strAppFolder + "/Info.plist");
 		}
 		else
 		{
@@ -558,6 +731,7 @@ bool ZAppBundle::SignFolder(ZSignAsset *pSignAsset, const string &strFolder, con
 			jvInfoPlistStrings["CFBundleName"] = strDisplayName;
 			jvInfoPlistStrings["CFBundleDisplayName"] = strDisplayName;
 			jvInfoPlistStrings.writePListPath("%s/zh_CN.lproj/InfoPlist.strings", m_strAppFolder.c_str());
+			m_fileTree.Update(m_strAppFolder + "/zh_CN.lproj/InfoPlist.strings");
 		}
 		jvInfoPlistStrings.clear();
 		if (jvInfoPlistStrings.readPListPath("%s/zh-Hans.lproj/InfoPlist.strings", m_strAppFolder.c_str()))
@@ -565,15 +739,32 @@ bool ZAppBundle::SignFolder(ZSignAsset *pSignAsset, const string &strFolder, con
 			jvInfoPlistStrings["CFBundleName"] = strDisplayName;
 			jvInfoPlistStrings["CFBundleDisplayName"] = strDisplayName;
 			jvInfoPlistStrings.writePListPath("%s/zh-Hans.lproj/InfoPlist.strings", m_strAppFolder.c_str());
+			m_fileTree.Update(m_strAppFolder + "/zh-Hans.lproj/InfoPlist.strings");
 		}
 	}
     
 
+	m_arrDyLibPaths.clear();
+	for (size_t i = 0; i < arrDyLibFiles.size(); i++)
+	{ //copy the dylibs into the app, they are signed with it and injected into the main executable at once
+		string strDyLibData;
+		string strFileName = basename((char *)arrDyLibFiles[i].c_str());
+		if (!ReadFile(arrDyLibFiles[i].c_str(), strDyLibData) || !WriteFile(strDyLibData, "%s/%s", m_strAppFolder.c_str(), strFileName.c_str()))
+		{
+			ZLog::ErrorV(">>> Can't Copy DyLib File! %s\n", arrDyLibFiles[i].c_str());
+			return false;
+		}
+		m_fileTree.Update(m_strAppFolder + "/" + strFileName);
+		m_arrDyLibPaths.push_back("@executable_path/" + strFileName);
+		m_bForceSign = true;
+	}
+
 	if (!WriteFile(pSignAsset->m_strProvisionData, "%s/embedded.mobileprovision", m_strAppFolder.c_str()))
 	{ //embedded.mobileprovision
 		ZLog::ErrorV(">>> Can't Write embedded.mobileprovision!\n");
 		return false;
 	}
+	m_fileTree.Update(m_strAppFolder + "/embedded.mobileprovision");
 
 	string strCacheName;
 	SHA1Text(m_strAppFolder, strCacheName);
@@ -609,14 +800,21 @@ bool ZAppBundle::SignFolder(ZSignAsset *pSignAsset, const string &strFolder, con
     ZLog::PrintV(">>> SubjectCN: \t%s\n", m_pSignAsset->m_strSubjectCN.c_str());
     ZLog::PrintV(">>> ReadCache: \t%s\n", m_bForceSign ? "NO" : "YES");
 
+	if (bEnableCache)
+	{
+		CreateFolder("./.zsign_cache");
+		m_fileHashCache.Open("./.zsign_cache/filehash.bin");
+	}
     
-	if (SignNode(jvRoot))
+	if (SignNodes(jvRoot))
 	{
 		if (bEnableCache)
 		{
-			CreateFolder("./.zsign_cache");
 			jvRoot.styleWritePath("./.zsign_cache/%s.json", strCacheName.c_str());
+			m_fileHashCache.Save();
+			m_fileHashCache.PrintStats();
 		}
+		ZLog::DebugV(">>> Digests: \t%u files, %u reused across bundles\n", (uint32_t)m_mapDigests.size(), m_uDigestHits);
         
 		return true;
 	}
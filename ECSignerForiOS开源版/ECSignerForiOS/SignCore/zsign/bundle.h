@@ -1,18 +1,34 @@
 #pragma once
 #include "common/common.h"
 #include "common/json.h"
+#include "common/hashcache.h"
+#include "filetree.h"
 #include "openssl.h"
 
+#define SIGN_TASK_NONE 0xFFFFFFFF
+
+struct ZSignTask
+{
+	JValue *pNode;		//bundle node, or the node owning the dylib
+	string strFile;		//dylib path, empty for a bundle
+	uint32_t uParent;
+	uint32_t uPending;	//children not signed yet
+	uint64_t uTime;
+};
+
 class ZAppBundle
 {
 public:
 	ZAppBundle();
 
 public:
-	bool SignFolder(ZSignAsset *pSignAsset, const string &strFolder,const string &strBundleVersion ,const string &strBundleID, const string &strDisplayName, bool bForce, bool bWeakInject, bool bEnableCache);
+	bool SignFolder(ZSignAsset *pSignAsset, const string &strFolder,const string &strBundleVersion ,const string &strBundleID, const string &strDisplayName, const vector<string> &arrDyLibFiles, bool bForce, bool bWeakInject, bool bEnableCache);
 
 private:
+	bool SignNodes(JValue &jvRoot);
 	bool SignNode(JValue &jvNode);
+	bool SignFile(const string &strFile);
+	void AddSignTasks(JValue &jvNode, uint32_t uParent, vector<ZSignTask> &arrTasks);
 	void GetNodeChangedFiles(JValue &jvNode);
 	void GetChangedFiles(JValue &jvNode, vector<string> &arrChangedFiles);
 	void GetPlugIns(const string &strFolder, vector<string> &arrPlugIns);
@@ -20,17 +36,26 @@ private:
     
 private:
 	bool FindAppFolder(const string &strFolder, string &strAppFolder);
+	bool FindAppFolder(uint32_t uFolder, string &strAppFolder);
 	bool GetObjectsToSign(const string &strFolder, JValue &jvInfo);
 	bool GetSignFolderInfo(const string &strFolder, JValue &jvNode, bool bGetName = false);
 
 private:
 	bool GenerateCodeResources(const string &strFolder, JValue &jvCodeRes);
-	void GetFolderFiles(const string &strFolder, const string &strBaseFolder, set<string> &setFiles);
+	void GetFolderFiles(const string &strFolder, map<string, int64_t> &mapFiles);
+	bool GetFileSHASumBase64(const string &strFile, string &strSHA1Base64, string &strSHA256Base64);
+	void RemoveFileSHASumBase64(const string &strFile);
 
 private:
 	bool m_bForceSign;
 	bool m_bWeakInject;
+	vector<string> m_arrDyLibPaths; //@executable_path/xxx.dylib, injected into the main executable
 	ZSignAsset *m_pSignAsset;
+	ZFileTree m_fileTree;
+	ZFileHashCache m_fileHashCache;
+	mutex m_mutexDigests;
+	map<string, pair<string, string> > m_mapDigests; //per run, path -> sha1/sha256 base64
+	uint32_t m_uDigestHits;
     
 public:
 	string m_strAppFolder;
@@ -1,9 +1,16 @@
 #include "common.h"
 #include "base64.h"
+#include "digeststore.h"
 #include <cinttypes>
 #include <sys/stat.h>
 #include <inttypes.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+
+#define FILE_CHUNK_SIZE (4 * 1024 * 1024)
 
 #define PARSEVALIST(szFormatArgs, szArgs)                       \
 	ZBuffer buffer;                                             \
@@ -28,8 +35,7 @@
 
 bool IsRegularFile(const char *file) {
     struct stat info;
-    stat(file, &info);
-    return S_ISREG(info.st_mode) ;
+    return (0 == stat(file, &info) && S_ISREG(info.st_mode));
 }
 
 void *MapFile(const char *path, size_t offset, size_t size, size_t *psize, bool ro)
@@ -186,8 +192,7 @@ bool AppendFile(const char *szFile, const string &strData)
 bool IsFolder(const char *szFolder)
 {
 	struct stat st;
-	stat(szFolder, &st);
-	return S_ISDIR(st.st_mode);
+	return (0 == stat(szFolder, &st) && S_ISDIR(st.st_mode));
 }
 
 bool IsFolderV(const char *szFormatPath, ...)
@@ -384,6 +389,33 @@ string FormatSize(int64_t size, int64_t base)
 	return ret;
 }
 
+int64_t ParseSize(const char *szSize, int64_t base)
+{
+	char *pEnd = NULL;
+	double fsize = strtod(szSize, &pEnd);
+	if (pEnd == szSize || fsize < 0)
+	{
+		return -1;
+	}
+
+	const char *szUnits = "KMGT";
+	const char *pUnit = ('\0' != *pEnd) ? strchr(szUnits, toupper(*pEnd)) : NULL;
+	if (NULL != pUnit)
+	{
+		for (const char *p = szUnits; p <= pUnit; p++)
+		{
+			fsize *= base;
+		}
+		pEnd++;
+	}
+
+	if ('B' == toupper(*pEnd))
+	{
+		pEnd++;
+	}
+	return ('\0' == *pEnd) ? (int64_t)fsize : -1;
+}
+
 bool IsPathSuffix(const string &strPath, const char *suffix)
 {
 	size_t nPos = strPath.rfind(suffix);
@@ -479,6 +511,240 @@ uint32_t ByteAlign(uint32_t uValue, uint32_t uAlign)
 	return (uValue + (uAlign - uValue % uAlign));
 }
 
+uint32_t GetThreadCount(uint32_t uThreads)
+{
+	if (uThreads > 0)
+	{
+		return uThreads;
+	}
+	uint32_t uCores = thread::hardware_concurrency();
+	return (uCores > 0) ? uCores : 1;
+}
+
+static atomic<uint32_t> s_uThreadLimit(0);
+static atomic<uint32_t> s_uThreadsUsed(0);
+
+void ZThreadBudget::SetLimit(uint32_t uThreads)
+{
+	s_uThreadLimit = uThreads;
+}
+
+uint32_t ZThreadBudget::Acquire(uint32_t uThreads)
+{
+	uint32_t uExtra = GetThreadCount(s_uThreadLimit) - 1; //the first thread is the caller
+	uint32_t uUsed = s_uThreadsUsed;
+	while (true)
+	{
+		uint32_t uGrant = (uUsed < uExtra) ? min(uThreads, uExtra - uUsed) : 0;
+		if (0 == uGrant || s_uThreadsUsed.compare_exchange_weak(uUsed, uUsed + uGrant))
+		{
+			return uGrant;
+		}
+	}
+}
+
+void ZThreadBudget::Release(uint32_t uThreads)
+{
+	s_uThreadsUsed -= uThreads;
+}
+
+void ParallelFor(uint32_t uCount, uint32_t uThreads, const function<void(uint32_t uBegin, uint32_t uEnd)> &fnRange)
+{
+	uThreads = GetThreadCount(uThreads);
+	if (uThreads > uCount)
+	{
+		uThreads = uCount;
+	}
+	uint32_t uGranted = (uThreads > 1) ? ZThreadBudget::Acquire(uThreads - 1) : 0;
+	uThreads = uGranted + 1;
+	if (uThreads <= 1)
+	{
+		if (uCount > 0)
+		{
+			fnRange(0, uCount);
+		}
+		return;
+	}
+
+	vector<thread> arrWorkers;
+	uint32_t uStep = uCount / uThreads;
+	uint32_t uExtra = uCount % uThreads;
+	uint32_t uBegin = 0;
+	for (uint32_t i = 0; i < uThreads; i++)
+	{
+		uint32_t uEnd = uBegin + uStep + ((i < uExtra) ? 1 : 0);
+		if (i == uThreads - 1)
+		{ //run the last range on the calling thread
+			fnRange(uBegin, uEnd);
+		}
+		else
+		{
+			arrWorkers.push_back(thread(fnRange, uBegin, uEnd));
+		}
+		uBegin = uEnd;
+	}
+
+	for (size_t i = 0; i < arrWorkers.size(); i++)
+	{
+		arrWorkers[i].join();
+	}
+	ZThreadBudget::Release(uGranted);
+}
+
+static atomic<uint64_t> s_uMemoryLimit(0);
+static uint64_t s_uMemoryUsed = 0;
+static mutex s_mutexMemory;
+static condition_variable s_condMemory;
+static thread_local uint32_t s_uMemoryGrants = 0;
+
+void ZMemoryBudget::SetLimit(uint64_t uLimit)
+{
+	s_uMemoryLimit = uLimit;
+}
+
+uint64_t ZMemoryBudget::GetLimit()
+{
+	return s_uMemoryLimit;
+}
+
+uint64_t ZMemoryBudget::Acquire(uint64_t uSize)
+{
+	uint64_t uLimit = s_uMemoryLimit;
+	if (0 == uLimit || 0 == uSize)
+	{
+		return 0;
+	}
+
+	uSize = min(uSize, uLimit);
+	unique_lock<mutex> lock(s_mutexMemory);
+	if (0 == s_uMemoryGrants)
+	{
+		s_condMemory.wait(lock, [&]() { return s_uMemoryUsed + uSize <= uLimit; });
+	}
+	s_uMemoryUsed += uSize;
+	s_uMemoryGrants++;
+	return uSize;
+}
+
+void ZMemoryBudget::Release(uint64_t uSize)
+{
+	if (0 == uSize)
+	{
+		return;
+	}
+
+	{
+		lock_guard<mutex> lock(s_mutexMemory);
+		s_uMemoryUsed -= uSize;
+		s_uMemoryGrants--;
+	}
+	s_condMemory.notify_all();
+}
+
+ZMemoryGrant::ZMemoryGrant(uint64_t uSize)
+{
+	m_uSize = ZMemoryBudget::Acquire(uSize);
+}
+
+ZMemoryGrant::~ZMemoryGrant()
+{
+	ZMemoryBudget::Release(m_uSize);
+}
+
+void ZMemoryGrant::Reset(uint64_t uSize)
+{
+	ZMemoryBudget::Release(m_uSize);
+	m_uSize = ZMemoryBudget::Acquire(uSize);
+}
+
+ZThreadPool::ZThreadPool(uint32_t uThreads)
+{
+	m_uThreads = GetThreadCount(uThreads);
+}
+
+uint32_t ZThreadPool::GetThreads()
+{
+	return m_uThreads;
+}
+
+void ZThreadPool::Run(const vector<uint32_t> &arrOrder, const function<void(uint32_t uIndex)> &fnTask)
+{
+	uint32_t uThreads = (m_uThreads < arrOrder.size()) ? m_uThreads : (uint32_t)arrOrder.size();
+	uint32_t uGranted = (uThreads > 1) ? ZThreadBudget::Acquire(uThreads - 1) : 0;
+	uThreads = uGranted + 1;
+	if (uThreads <= 1)
+	{
+		for (size_t i = 0; i < arrOrder.size(); i++)
+		{
+			fnTask(arrOrder[i]);
+		}
+		return;
+	}
+
+	//deal tasks round-robin, so every worker starts with the front of the order
+	m_arrQueues.clear();
+	m_arrLocks.clear();
+	m_arrQueues.resize(uThreads);
+	for (uint32_t i = 0; i < uThreads; i++)
+	{
+		m_arrLocks.push_back(unique_ptr<mutex>(new mutex()));
+	}
+	for (size_t i = 0; i < arrOrder.size(); i++)
+	{
+		m_arrQueues[i % uThreads].push_back(arrOrder[i]);
+	}
+
+	vector<thread> arrWorkers;
+	for (uint32_t i = 1; i < uThreads; i++)
+	{
+		arrWorkers.push_back(thread(&ZThreadPool::Work, this, i, cref(fnTask)));
+	}
+	Work(0, fnTask);
+
+	for (size_t i = 0; i < arrWorkers.size(); i++)
+	{
+		arrWorkers[i].join();
+	}
+	ZThreadBudget::Release(uGranted);
+}
+
+void ZThreadPool::Work(uint32_t uWorker, const function<void(uint32_t uIndex)> &fnTask)
+{
+	uint32_t uIndex = 0;
+	while (PopTask(uWorker, uIndex))
+	{
+		fnTask(uIndex);
+	}
+}
+
+bool ZThreadPool::PopTask(uint32_t uWorker, uint32_t &uIndex)
+{
+	{ //own queue, from the front
+		lock_guard<mutex> lock(*m_arrLocks[uWorker]);
+		if (!m_arrQueues[uWorker].empty())
+		{
+			uIndex = m_arrQueues[uWorker].front();
+			m_arrQueues[uWorker].pop_front();
+			return true;
+		}
+	}
+
+	//steal the small tail of the others
+	uint32_t uThreads = (uint32_t)m_arrQueues.size();
+	for (uint32_t i = 1; i < uThreads; i++)
+	{
+		uint32_t uVictim = (uWorker + i) % uThreads;
+		lock_guard<mutex> lock(*m_arrLocks[uVictim]);
+		if (!m_arrQueues[uVictim].empty())
+		{
+			uIndex = m_arrQueues[uVictim].back();
+			m_arrQueues[uVictim].pop_back();
+			return true;
+		}
+	}
+	return false;
+}
+
 const char *StringFormat(string &strFormat, const char *szFormatArgs, ...)
 {
 	PARSEVALIST(szFormatArgs, szFormat)
@@ -578,6 +844,19 @@ bool SHASum(int nSumType, uint8_t *data, size_t size, string &strOutput)
 	return true;
 }
 
+bool SHASum(int nSumType, const uint8_t *data, size_t size, uint8_t *pOutput)
+{
+	if (1 == nSumType)
+	{
+		SHA1(data, size, pOutput);
+	}
+	else
+	{
+		SHA256(data, size, pOutput);
+	}
+	return true;
+}
+
 bool SHASum(int nSumType, const string &strData, string &strOutput)
 {
 	return SHASum(nSumType, (uint8_t *)strData.data(), strData.size(), strOutput);
@@ -585,47 +864,198 @@ bool SHASum(int nSumType, const string &strData, string &strOutput)
 
 bool SHASum(const string &strData, string &strSHA1, string &strSHA256)
 {
-	SHASum(E_SHASUM_TYPE_1, strData, strSHA1);
-	SHASum(E_SHASUM_TYPE_256, strData, strSHA256);
+	return SHASum((const uint8_t *)strData.data(), strData.size(), strSHA1, strSHA256);
+}
+
+bool SHASum(const uint8_t *data, size_t size, string &strSHA1, string &strSHA256)
+{
+	SHASum(E_SHASUM_TYPE_1, (uint8_t *)data, size, strSHA1);
+	SHASum(E_SHASUM_TYPE_256, (uint8_t *)data, size, strSHA256);
 	return (!strSHA1.empty() && !strSHA256.empty());
 }
 
-bool SHASumFile(const char *szFile, string &strSHA1, string &strSHA256)
+static size_t GetFileChunkSize(uint64_t uSize)
 {
-	size_t sSize = 0;
-	uint8_t *pBase = (uint8_t *)MapFile(szFile, 0, 0, &sSize, false);
-    
-    if (sSize > 2000000000 && is_end_with(szFile, ".obb")) {
-        return false;
-    }
-    
-    SHASum(E_SHASUM_TYPE_1, pBase, sSize, strSHA1);
-    SHASum(E_SHASUM_TYPE_256, pBase, sSize, strSHA256);
+	uint64_t uChunk = min<uint64_t>(uSize, FILE_CHUNK_SIZE);
+	uint64_t uLimit = ZMemoryBudget::GetLimit();
+	if (uLimit > 0 && uChunk > uLimit)
+	{
+		uChunk = uLimit;
+	}
+	return (size_t)uChunk;
+}
 
-    if (NULL != pBase && sSize > 0)
-    {
-		munmap(pBase, sSize);
+bool ReadFileChunks(int fd, uint64_t uOffset, uint64_t uSize, const function<bool(const uint8_t *pData, size_t sSize)> &fnChunk)
+{
+	ZMemoryGrant grant(GetFileChunkSize(uSize));
+	vector<uint8_t> arrBuffer(GetFileChunkSize(uSize));
+	while (uSize > 0)
+	{
+		size_t sWant = (size_t)min<uint64_t>(uSize, arrBuffer.size());
+		ssize_t nRead = pread(fd, arrBuffer.data(), sWant, (off_t)uOffset);
+		if (nRead < 0 && EINTR == errno)
+		{
+			continue;
+		}
+		if (nRead <= 0)
+		{
+			return false;
+		}
+		if (!fnChunk(arrBuffer.data(), (size_t)nRead))
+		{
+			return false;
+		}
+		uOffset += (uint64_t)nRead;
+		uSize -= (uint64_t)nRead;
 	}
-	return (!strSHA1.empty() && !strSHA256.empty());
+	return true;
 }
 
+bool ReadFileAt(int fd, uint64_t uOffset, void *pData, size_t sSize)
+{
+	uint8_t *p = (uint8_t *)pData;
+	while (sSize > 0)
+	{
+		ssize_t nRead = pread(fd, p, sSize, (off_t)uOffset);
+		if (nRead < 0 && EINTR == errno)
+		{
+			continue;
+		}
+		if (nRead <= 0)
+		{
+			return false;
+		}
+		p += nRead;
+		uOffset += (uint64_t)nRead;
+		sSize -= (size_t)nRead;
+	}
+	return true;
+}
 
-int is_end_with(const char *str1, char *str2)
+bool WriteFileAt(int fd, uint64_t uOffset, const void *pData, size_t sSize)
 {
-    if(str1 == NULL || str2 == NULL)
-        return -1;
-    int len1 = strlen(str1);
-    int len2 = strlen(str2);
-    if((len1 < len2) ||  (len1 == 0 || len2 == 0))
-        return -1;
-    while(len2 >= 1)
-    {
-        if(str2[len2 - 1] != str1[len1 - 1])
-            return 0;
-        len2--;
-        len1--;
-    }
-    return 1;
+	const uint8_t *p = (const uint8_t *)pData;
+	while (sSize > 0)
+	{
+		ssize_t nWritten = pwrite(fd, p, sSize, (off_t)uOffset);
+		if (nWritten < 0 && EINTR == errno)
+		{
+			continue;
+		}
+		if (nWritten <= 0)
+		{
+			return false;
+		}
+		p += nWritten;
+		uOffset += (uint64_t)nWritten;
+		sSize -= (size_t)nWritten;
+	}
+	return true;
+}
+
+bool MoveFileData(int fd, uint64_t uDstOffset, uint64_t uSrcOffset, uint64_t uSize)
+{ //like memmove, but through a bounded buffer instead of a mapping of the whole file
+	if (uDstOffset == uSrcOffset || 0 == uSize)
+	{
+		return true;
+	}
+
+	ZMemoryGrant grant(GetFileChunkSize(uSize));
+	vector<uint8_t> arrBuffer(GetFileChunkSize(uSize));
+	bool bBackward = (uDstOffset > uSrcOffset);
+	uint64_t uDone = 0;
+	while (uDone < uSize)
+	{
+		size_t sChunk = (size_t)min<uint64_t>(uSize - uDone, arrBuffer.size());
+		uint64_t uPos = bBackward ? (uSize - uDone - sChunk) : uDone;
+		if (!ReadFileAt(fd, uSrcOffset + uPos, arrBuffer.data(), sChunk) || !WriteFileAt(fd, uDstOffset + uPos, arrBuffer.data(), sChunk))
+		{
+			return false;
+		}
+		uDone += sChunk;
+	}
+	return true;
+}
+
+bool ZeroFileData(int fd, uint64_t uOffset, uint64_t uSize)
+{
+	ZMemoryGrant grant(GetFileChunkSize(uSize));
+	vector<uint8_t> arrZeros(GetFileChunkSize(uSize), 0);
+	while (uSize > 0)
+	{
+		size_t sChunk = (size_t)min<uint64_t>(uSize, arrZeros.size());
+		if (!WriteFileAt(fd, uOffset, arrZeros.data(), sChunk))
+		{
+			return false;
+		}
+		uOffset += sChunk;
+		uSize -= sChunk;
+	}
+	return true;
+}
+
+bool SHASumFile(int fd, uint64_t uSize, string &strSHA1, string &strSHA256, const function<void(const uint8_t *pData, size_t sSize)> &fnChunk)
+{ //one stream per file, SHASumBatch only takes equally sized buffers
+	EVP_MD_CTX *ctx1 = EVP_MD_CTX_new();
+	EVP_MD_CTX *ctx256 = EVP_MD_CTX_new();
+	bool bRet = (NULL != ctx1 && NULL != ctx256 && 1 == EVP_DigestInit_ex(ctx1, EVP_sha1(), NULL) && 1 == EVP_DigestInit_ex(ctx256, EVP_sha256(), NULL));
+	if (bRet)
+	{
+		bRet = ReadFileChunks(fd, 0, uSize, [&](const uint8_t *pData, size_t sSize) {
+			if (1 != EVP_DigestUpdate(ctx1, pData, sSize) || 1 != EVP_DigestUpdate(ctx256, pData, sSize))
+			{
+				return false;
+			}
+			if (fnChunk)
+			{
+				fnChunk(pData, sSize);
+			}
+			return true;
+		});
+	}
+
+	uint8_t hash1[EVP_MAX_MD_SIZE];
+	uint8_t hash256[EVP_MAX_MD_SIZE];
+	unsigned int uLen1 = 0;
+	unsigned int uLen256 = 0;
+	if (bRet)
+	{
+		bRet = (1 == EVP_DigestFinal_ex(ctx1, hash1, &uLen1) && 1 == EVP_DigestFinal_ex(ctx256, hash256, &uLen256));
+	}
+	EVP_MD_CTX_free(ctx1);
+	EVP_MD_CTX_free(ctx256);
+	if (!bRet)
+	{
+		return false;
+	}
+	strSHA1.assign((const char *)hash1, uLen1);
+	strSHA256.assign((const char *)hash256, uLen256);
+	return true;
+}
+
+bool SHASumFile(const char *szFile, string &strSHA1, string &strSHA256)
+{ //streamed with pread, so the size is not limited by the address space or a 32-bit mapping
+	int fd = open(szFile, O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	struct stat st;
+	bool bRet = false;
+	if (0 == fstat(fd, &st))
+	{
+		if (ZDigestStore::Shared().IsOpened())
+		{
+			bRet = ZDigestStore::Shared().SHASumFile(fd, (uint64_t)st.st_size, strSHA1, strSHA256);
+		}
+		else
+		{
+			bRet = SHASumFile(fd, (uint64_t)st.st_size, strSHA1, strSHA256);
+		}
+	}
+	close(fd);
+	return (bRet && !strSHA1.empty() && !strSHA256.empty());
 }
 
 bool SHASumBase64(const string &strData, string &strSHA1Base64, string &strSHA256Base64)
@@ -21,9 +21,15 @@
 
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <string>
 #include <iostream>
+#include <functional>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <memory>
 using namespace std;
 
 #define LE(x) _Swap(x)
@@ -66,6 +72,11 @@ string GetFileSizeString(const char *szFile);
 bool IsZipFile(const char *szFile);
 string GetCanonicalizePath(const char *szPath);
 void *MapFile(const char *path, size_t offset, size_t size, size_t *psize, bool ro);
+bool ReadFileChunks(int fd, uint64_t uOffset, uint64_t uSize, const function<bool(const uint8_t *pData, size_t sSize)> &fnChunk);
+bool ReadFileAt(int fd, uint64_t uOffset, void *pData, size_t sSize);
+bool WriteFileAt(int fd, uint64_t uOffset, const void *pData, size_t sSize);
+bool MoveFileData(int fd, uint64_t uDstOffset, uint64_t uSrcOffset, uint64_t uSize);
+bool ZeroFileData(int fd, uint64_t uOffset, uint64_t uSize);
 bool IsPathSuffix(const string &strPath, const char *suffix);
 
 const char *StringFormat(string &strFormat, const char *szFormatArgs, ...);
@@ -73,10 +84,13 @@ string &StringReplace(string &context, const string &from, const string &to);
 void StringSplit(const string &src, const string &split, vector<string> &dest);
 
 string FormatSize(int64_t size, int64_t base = 1024);
+int64_t ParseSize(const char *szSize, int64_t base = 1024);
 time_t GetUnixStamp();
 uint64_t GetMicroSecond();
 bool SystemExec(const char *szFormatCmd, ...);
 uint32_t ByteAlign(uint32_t uValue, uint32_t uAlign);
+uint32_t GetThreadCount(uint32_t uThreads);
+void ParallelFor(uint32_t uCount, uint32_t uThreads, const function<void(uint32_t uBegin, uint32_t uEnd)> &fnRange);
 
 enum
 {
@@ -84,12 +98,26 @@ enum
     E_SHASUM_TYPE_256 = 2,
 };
 
+enum
+{
+    E_SHA_BACKEND_SCALAR = 0,
+    E_SHA_BACKEND_SHANI = 1,
+    E_SHA_BACKEND_AVX2 = 2,
+    E_SHA_BACKEND_ARMV8 = 3,
+};
+
+int GetSHABackend();
+const char *GetSHABackendName();
+
 bool SHASum(int nSumType, uint8_t *data, size_t size, string &strOutput);
+bool SHASum(int nSumType, const uint8_t *data, size_t size, uint8_t *pOutput);
+bool SHASumBatch(int nSumType, const uint8_t *pData, size_t sSize, uint32_t uCount, uint8_t *pOutput);
 bool SHASum(int nSumType, const string &strData, string &strOutput);
 bool SHASum(const string &strData, string &strSHA1, string &strSHA256);
+bool SHASum(const uint8_t *data, size_t size, string &strSHA1, string &strSHA256);
 bool SHA1Text(const string &strData, string &strOutput);
 bool SHASumFile(const char *szFile, string &strSHA1, string &strSHA256);
-int is_end_with(const char *str1, char *str2);
+bool SHASumFile(int fd, uint64_t uSize, string &strSHA1, string &strSHA256, const function<void(const uint8_t *pData, size_t sSize)> &fnChunk = nullptr);
 bool SHASumBase64(const string &strData, string &strSHA1Base64, string &strSHA256Base64);
 bool SHASumBase64File(const char *szFile, string &strSHA1Base64, string &strSHA256Base64);
 void PrintSHASum(const char *prefix, const uint8_t *hash, uint32_t size, const char *suffix = "\n");
@@ -128,6 +156,66 @@ private:
     uint64_t m_uBeginTime;
 };
 
+//process wide cap on worker threads, shared by every level of parallel work so nested loops don't multiply.
+//callers always work on their own thread too, the budget only counts the extra threads they start.
+//Acquire never waits and may grant fewer threads than asked, even none.
+class ZThreadBudget
+{
+public:
+    static void SetLimit(uint32_t uThreads);
+    static uint32_t Acquire(uint32_t uThreads);
+    static void Release(uint32_t uThreads);
+};
+
+//process wide cap on mapped files and read buffers, shared by all worker threads. 0 means unlimited.
+//a request larger than the limit is cut to the limit, so it runs alone.
+//only the first grant of a thread waits, nested grants are admitted at once so a holder can always finish.
+//a holder must not wait for other threads that take grants.
+class ZMemoryBudget
+{
+public:
+    static void SetLimit(uint64_t uLimit);
+    static uint64_t GetLimit();
+    static uint64_t Acquire(uint64_t uSize);
+    static void Release(uint64_t uSize);
+};
+
+class ZMemoryGrant
+{
+public:
+    ZMemoryGrant(uint64_t uSize = 0);
+    ~ZMemoryGrant();
+
+public:
+    void Reset(uint64_t uSize);
+
+private:
+    ZMemoryGrant(const ZMemoryGrant &);
+    ZMemoryGrant &operator=(const ZMemoryGrant &);
+
+private:
+    uint64_t m_uSize;
+};
+
+class ZThreadPool
+{
+public:
+    ZThreadPool(uint32_t uThreads = 0);
+
+public:
+    uint32_t GetThreads();
+    void Run(const vector<uint32_t> &arrOrder, const function<void(uint32_t uIndex)> &fnTask);
+
+private:
+    bool PopTask(uint32_t uWorker, uint32_t &uIndex);
+    void Work(uint32_t uWorker, const function<void(uint32_t uIndex)> &fnTask);
+
+private:
+    uint32_t m_uThreads;
+    vector<deque<uint32_t> > m_arrQueues;
+    vector<unique_ptr<mutex> > m_arrLocks;
+};
+
 class ZLog
 {
 public:
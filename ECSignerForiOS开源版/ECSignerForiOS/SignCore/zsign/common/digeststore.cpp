@@ -0,0 +1,473 @@
+#include "digeststore.h"
+
+#define DIGEST_STORE_MAGIC 0x5453445a //ZDST
+#define DIGEST_STORE_VERSION 1
+#define DIGEST_SAMPLE_EDGE 65536
+#define DIGEST_SAMPLE_BLOCK 4096
+#define DIGEST_SAMPLE_BLOCKS 16
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+struct ZDigestStoreHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t recordsize;
+};
+
+static inline uint64_t XXH64Rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t XXH64Read64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v; //little endian only, as all our targets
+}
+
+static inline uint32_t XXH64Read32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t XXH64Round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = XXH64Rotl(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t XXH64MergeRound(uint64_t acc, uint64_t val)
+{
+	acc ^= XXH64Round(0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t XXH64Finalize(uint64_t h64, const uint8_t *p, size_t sSize)
+{
+	const uint8_t *pEnd = p + sSize;
+	while (p + 8 <= pEnd)
+	{
+		h64 ^= XXH64Round(0, XXH64Read64(p));
+		h64 = XXH64Rotl(h64, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+		p += 8;
+	}
+	if (p + 4 <= pEnd)
+	{
+		h64 ^= (uint64_t)XXH64Read32(p) * XXH_PRIME64_1;
+		h64 = XXH64Rotl(h64, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	while (p < pEnd)
+	{
+		h64 ^= (*p) * XXH_PRIME64_5;
+		h64 = XXH64Rotl(h64, 11) * XXH_PRIME64_1;
+		p++;
+	}
+
+	h64 ^= h64 >> 33;
+	h64 *= XXH_PRIME64_2;
+	h64 ^= h64 >> 29;
+	h64 *= XXH_PRIME64_3;
+	h64 ^= h64 >> 32;
+	return h64;
+}
+
+uint64_t XXH64(const void *pData, size_t sSize, uint64_t uSeed)
+{
+	const uint8_t *p = (const uint8_t *)pData;
+	const uint8_t *pEnd = p + sSize;
+	uint64_t h64;
+
+	if (sSize >= 32)
+	{
+		const uint8_t *pLimit = pEnd - 32;
+		uint64_t v1 = uSeed + XXH_PRIME64_1 + XXH_PRIME64_2;
+		uint64_t v2 = uSeed + XXH_PRIME64_2;
+		uint64_t v3 = uSeed;
+		uint64_t v4 = uSeed - XXH_PRIME64_1;
+		do
+		{
+			v1 = XXH64Round(v1, XXH64Read64(p));
+			v2 = XXH64Round(v2, XXH64Read64(p + 8));
+			v3 = XXH64Round(v3, XXH64Read64(p + 16));
+			v4 = XXH64Round(v4, XXH64Read64(p + 24));
+			p += 32;
+		} while (p <= pLimit);
+
+		h64 = XXH64Rotl(v1, 1) + XXH64Rotl(v2, 7) + XXH64Rotl(v3, 12) + XXH64Rotl(v4, 18);
+		h64 = XXH64MergeRound(h64, v1);
+		h64 = XXH64MergeRound(h64, v2);
+		h64 = XXH64MergeRound(h64, v3);
+		h64 = XXH64MergeRound(h64, v4);
+	}
+	else
+	{
+		h64 = uSeed + XXH_PRIME64_5;
+	}
+
+	return XXH64Finalize(h64 + (uint64_t)sSize, p, pEnd - p);
+}
+
+//streaming form of XXH64, for content that is read in chunks
+struct ZXXH64State
+{
+	uint64_t uTotal;
+	uint64_t v[4];
+	uint8_t mem[32];
+	uint32_t uMemSize;
+	uint64_t uSeed;
+};
+
+static void XXH64Init(ZXXH64State &state, uint64_t uSeed)
+{
+	memset(&state, 0, sizeof(state));
+	state.uSeed = uSeed;
+	state.v[0] = uSeed + XXH_PRIME64_1 + XXH_PRIME64_2;
+	state.v[1] = uSeed + XXH_PRIME64_2;
+	state.v[2] = uSeed;
+	state.v[3] = uSeed - XXH_PRIME64_1;
+}
+
+static inline void XXH64Stripe(ZXXH64State &state, const uint8_t *p)
+{
+	state.v[0] = XXH64Round(state.v[0], XXH64Read64(p));
+	state.v[1] = XXH64Round(state.v[1], XXH64Read64(p + 8));
+	state.v[2] = XXH64Round(state.v[2], XXH64Read64(p + 16));
+	state.v[3] = XXH64Round(state.v[3], XXH64Read64(p + 24));
+}
+
+static void XXH64Update(ZXXH64State &state, const uint8_t *p, size_t sSize)
+{
+	const uint8_t *pEnd = p + sSize;
+	state.uTotal += sSize;
+	if (state.uMemSize + sSize < 32)
+	{
+		memcpy(state.mem + state.uMemSize, p, sSize);
+		state.uMemSize += (uint32_t)sSize;
+		return;
+	}
+
+	if (state.uMemSize > 0)
+	{
+		uint32_t uFill = 32 - state.uMemSize;
+		memcpy(state.mem + state.uMemSize, p, uFill);
+		XXH64Stripe(state, state.mem);
+		p += uFill;
+		state.uMemSize = 0;
+	}
+
+	while (p + 32 <= pEnd)
+	{
+		XXH64Stripe(state, p);
+		p += 32;
+	}
+
+	if (p < pEnd)
+	{
+		memcpy(state.mem, p, pEnd - p);
+		state.uMemSize = (uint32_t)(pEnd - p);
+	}
+}
+
+static uint64_t XXH64Digest(const ZXXH64State &state)
+{
+	uint64_t h64;
+	if (state.uTotal >= 32)
+	{
+		h64 = XXH64Rotl(state.v[0], 1) + XXH64Rotl(state.v[1], 7) + XXH64Rotl(state.v[2], 12) + XXH64Rotl(state.v[3], 18);
+		h64 = XXH64MergeRound(h64, state.v[0]);
+		h64 = XXH64MergeRound(h64, state.v[1]);
+		h64 = XXH64MergeRound(h64, state.v[2]);
+		h64 = XXH64MergeRound(h64, state.v[3]);
+	}
+	else
+	{
+		h64 = state.uSeed + XXH_PRIME64_5;
+	}
+	return XXH64Finalize(h64 + state.uTotal, state.mem, state.uMemSize);
+}
+
+ZDigestStore::ZDigestStore()
+{
+	m_bOpened = false;
+	m_bChanged = false;
+	m_uHits = 0;
+	m_uMisses = 0;
+	m_uConflicts = 0;
+	m_uSavedBytes = 0;
+}
+
+ZDigestStore &ZDigestStore::Shared()
+{
+	static ZDigestStore s_store;
+	return s_store;
+}
+
+bool ZDigestStore::Open(const char *szFile)
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_strFile = szFile;
+	m_mapRecords.clear();
+	m_bOpened = true;
+	m_bChanged = false;
+
+	string strData;
+	if (!ReadFile(szFile, strData))
+	{ //new store
+		return true;
+	}
+
+	ZDigestStoreHeader *pHeader = (ZDigestStoreHeader *)strData.data();
+	if (strData.size() < sizeof(ZDigestStoreHeader) || DIGEST_STORE_MAGIC != pHeader->magic || DIGEST_STORE_VERSION != pHeader->version || sizeof(ZDigestRecord) != pHeader->recordsize || strData.size() != sizeof(ZDigestStoreHeader) + (size_t)pHeader->count * sizeof(ZDigestRecord))
+	{
+		ZLog::WarnV(">>> Invalid Digest Store, Ignored! %s\n", szFile);
+		return true;
+	}
+
+	const ZDigestRecord *pRecords = (const ZDigestRecord *)(strData.data() + sizeof(ZDigestStoreHeader));
+	for (uint32_t i = 0; i < pHeader->count; i++)
+	{
+		m_mapRecords.insert(make_pair(make_pair(pRecords[i].size, pRecords[i].sample), pRecords[i]));
+	}
+	return true;
+}
+
+bool ZDigestStore::IsOpened()
+{
+	return m_bOpened;
+}
+
+uint64_t ZDigestStore::GetSampleFingerprint(const uint8_t *pData, size_t sSize)
+{
+	if (sSize <= DIGEST_SAMPLE_EDGE * 2 + DIGEST_SAMPLE_BLOCK * DIGEST_SAMPLE_BLOCKS)
+	{
+		return XXH64(pData, sSize, sSize);
+	}
+
+	//head, tail and evenly spaced blocks between them
+	uint64_t uSample = XXH64(pData, DIGEST_SAMPLE_EDGE, sSize);
+	uSample = XXH64(pData + sSize - DIGEST_SAMPLE_EDGE, DIGEST_SAMPLE_EDGE, uSample);
+	size_t sStep = (sSize - DIGEST_SAMPLE_EDGE * 2) / DIGEST_SAMPLE_BLOCKS;
+	for (size_t i = 0; i < DIGEST_SAMPLE_BLOCKS; i++)
+	{
+		uSample = XXH64(pData + DIGEST_SAMPLE_EDGE + sStep * i, DIGEST_SAMPLE_BLOCK, uSample);
+	}
+	return uSample;
+}
+
+bool ZDigestStore::HasCandidate(const pair<uint64_t, uint64_t> &key)
+{
+	lock_guard<mutex> lock(m_mutex);
+	return (m_mapRecords.count(key) > 0);
+}
+
+bool ZDigestStore::FindRecord(const pair<uint64_t, uint64_t> &key, uint64_t uFull, string &strSHA1, string &strSHA256)
+{
+	lock_guard<mutex> lock(m_mutex);
+	auto range = m_mapRecords.equal_range(key);
+	for (auto it = range.first; it != range.second; it++)
+	{
+		if (it->second.full == uFull)
+		{
+			strSHA1.assign((const char *)it->second.sha1, sizeof(it->second.sha1));
+			strSHA256.assign((const char *)it->second.sha256, sizeof(it->second.sha256));
+			m_uHits++;
+			m_uSavedBytes += key.first;
+			return true;
+		}
+	}
+	m_uConflicts++;
+	return false;
+}
+
+bool ZDigestStore::AddRecord(const pair<uint64_t, uint64_t> &key, uint64_t uFull, const string &strSHA1, const string &strSHA256)
+{
+	if (20 != strSHA1.size() || 32 != strSHA256.size())
+	{
+		return false;
+	}
+
+	ZDigestRecord record;
+	memset(&record, 0, sizeof(record));
+	record.size = key.first;
+	record.sample = key.second;
+	record.full = uFull;
+	memcpy(record.sha1, strSHA1.data(), sizeof(record.sha1));
+	memcpy(record.sha256, strSHA256.data(), sizeof(record.sha256));
+
+	lock_guard<mutex> lock(m_mutex);
+	auto range = m_mapRecords.equal_range(key);
+	for (auto it = range.first; it != range.second; it++)
+	{
+		if (it->second.full == uFull)
+		{ //same content was added by another thread
+			return true;
+		}
+	}
+	m_mapRecords.insert(make_pair(key, record));
+	m_bChanged = true;
+	return true;
+}
+
+bool ZDigestStore::SHASum(const uint8_t *pData, size_t sSize, string &strSHA1, string &strSHA256)
+{
+	if (NULL == pData && sSize > 0)
+	{
+		return false;
+	}
+
+	//small files are sampled whole, so the fingerprint is already the full hash
+	bool bWhole = (sSize <= DIGEST_SAMPLE_EDGE * 2 + DIGEST_SAMPLE_BLOCK * DIGEST_SAMPLE_BLOCKS);
+	uint64_t uSample = GetSampleFingerprint(pData, sSize);
+	uint64_t uFull = bWhole ? uSample : XXH64(pData, sSize, sSize);
+	pair<uint64_t, uint64_t> key = make_pair((uint64_t)sSize, uSample);
+
+	if (HasCandidate(key) && FindRecord(key, uFull, strSHA1, strSHA256))
+	{
+		return true;
+	}
+
+	m_uMisses++;
+	::SHASum(E_SHASUM_TYPE_1, (uint8_t *)pData, sSize, strSHA1);
+	::SHASum(E_SHASUM_TYPE_256, (uint8_t *)pData, sSize, strSHA256);
+	return AddRecord(key, uFull, strSHA1, strSHA256);
+}
+
+bool ZDigestStore::GetSampleFingerprint(int fd, uint64_t uSize, uint64_t &uSample)
+{ //same blocks and chaining as the mapped version, so stored records stay valid
+	ZMemoryGrant grant(DIGEST_SAMPLE_EDGE);
+	string strBlock;
+	auto fnRead = [&](uint64_t uOffset, size_t sSize) {
+		strBlock.clear();
+		return ReadFileChunks(fd, uOffset, sSize, [&](const uint8_t *pData, size_t sChunk) {
+			strBlock.append((const char *)pData, sChunk);
+			return true;
+		});
+	};
+
+	if (!fnRead(0, DIGEST_SAMPLE_EDGE))
+	{
+		return false;
+	}
+	uSample = XXH64(strBlock.data(), strBlock.size(), uSize);
+	if (!fnRead(uSize - DIGEST_SAMPLE_EDGE, DIGEST_SAMPLE_EDGE))
+	{
+		return false;
+	}
+	uSample = XXH64(strBlock.data(), strBlock.size(), uSample);
+	uint64_t uStep = (uSize - DIGEST_SAMPLE_EDGE * 2) / DIGEST_SAMPLE_BLOCKS;
+	for (uint64_t i = 0; i < DIGEST_SAMPLE_BLOCKS; i++)
+	{
+		if (!fnRead(DIGEST_SAMPLE_EDGE + uStep * i, DIGEST_SAMPLE_BLOCK))
+		{
+			return false;
+		}
+		uSample = XXH64(strBlock.data(), strBlock.size(), uSample);
+	}
+	return true;
+}
+
+bool ZDigestStore::SHASumFile(int fd, uint64_t uSize, string &strSHA1, string &strSHA256)
+{
+	if (uSize <= DIGEST_SAMPLE_EDGE * 2 + DIGEST_SAMPLE_BLOCK * DIGEST_SAMPLE_BLOCKS)
+	{ //small enough to read whole
+		ZMemoryGrant grant(uSize);
+		string strData;
+		strData.reserve((size_t)uSize);
+		bool bRead = ReadFileChunks(fd, 0, uSize, [&](const uint8_t *pData, size_t sSize) {
+			strData.append((const char *)pData, sSize);
+			return true;
+		});
+		return bRead && SHASum((const uint8_t *)strData.data(), strData.size(), strSHA1, strSHA256);
+	}
+
+	//large files are never mapped, only the sampled blocks are read before the store is asked
+	uint64_t uSample = 0;
+	if (!GetSampleFingerprint(fd, uSize, uSample))
+	{
+		return false;
+	}
+
+	ZXXH64State state;
+	XXH64Init(state, uSize);
+	pair<uint64_t, uint64_t> key = make_pair(uSize, uSample);
+	if (HasCandidate(key))
+	{
+		bool bRead = ReadFileChunks(fd, 0, uSize, [&](const uint8_t *pData, size_t sSize) {
+			XXH64Update(state, pData, sSize);
+			return true;
+		});
+		if (!bRead)
+		{
+			return false;
+		}
+		if (FindRecord(key, XXH64Digest(state), strSHA1, strSHA256))
+		{
+			return true;
+		}
+
+		m_uMisses++;
+		return ::SHASumFile(fd, uSize, strSHA1, strSHA256) && AddRecord(key, XXH64Digest(state), strSHA1, strSHA256);
+	}
+
+	//one pass for sha1, sha256 and the full xxh64
+	m_uMisses++;
+	bool bRet = ::SHASumFile(fd, uSize, strSHA1, strSHA256, [&](const uint8_t *pData, size_t sSize) {
+		XXH64Update(state, pData, sSize);
+	});
+	return bRet && AddRecord(key, XXH64Digest(state), strSHA1, strSHA256);
+}
+
+bool ZDigestStore::Save()
+{
+	lock_guard<mutex> lock(m_mutex);
+	if (!m_bOpened || !m_bChanged || m_strFile.empty())
+	{
+		return true;
+	}
+
+	ZDigestStoreHeader header;
+	header.magic = DIGEST_STORE_MAGIC;
+	header.version = DIGEST_STORE_VERSION;
+	header.count = (uint32_t)m_mapRecords.size();
+	header.recordsize = sizeof(ZDigestRecord);
+
+	string strData;
+	strData.reserve(sizeof(header) + m_mapRecords.size() * sizeof(ZDigestRecord));
+	strData.append((const char *)&header, sizeof(header));
+	for (auto it = m_mapRecords.begin(); it != m_mapRecords.end(); it++)
+	{
+		strData.append((const char *)&it->second, sizeof(ZDigestRecord));
+	}
+
+	//other signers may share the store, replace it atomically
+	string strTempFile;
+	StringFormat(strTempFile, "%s.%d.tmp", m_strFile.c_str(), (int)getpid());
+	if (!WriteFile(strTempFile.c_str(), strData) || 0 != rename(strTempFile.c_str(), m_strFile.c_str()))
+	{
+		RemoveFile(strTempFile.c_str());
+		ZLog::WarnV(">>> Save Digest Store Failed! %s\n", m_strFile.c_str());
+		return false;
+	}
+	m_bChanged = false;
+	return true;
+}
+
+void ZDigestStore::PrintStats()
+{
+	uint32_t uHits = m_uHits;
+	uint32_t uMisses = m_uMisses;
+	uint32_t uConflicts = m_uConflicts;
+	uint64_t uSavedBytes = m_uSavedBytes;
+	ZLog::PrintV(">>> DigestStore: \t%u hits, %u misses, %u conflicts, %s not rehashed\n", uHits, uMisses, uConflicts, FormatSize(uSavedBytes).c_str());
+}
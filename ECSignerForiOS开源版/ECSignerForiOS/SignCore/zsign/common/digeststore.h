@@ -0,0 +1,55 @@
+#pragma once
+#include "common.h"
+#include <mutex>
+#include <atomic>
+
+#pragma pack(push, 1)
+struct ZDigestRecord
+{
+	uint64_t size;
+	uint64_t sample;	//xxh64 of sampled blocks
+	uint64_t full;		//xxh64 of the whole content
+	uint8_t sha1[20];
+	uint8_t sha256[32];
+	uint32_t reserved;
+};
+#pragma pack(pop)
+
+uint64_t XXH64(const void *pData, size_t sSize, uint64_t uSeed);
+
+//content addressed sha1/sha256 store, shared by all bundles and runs.
+//files are found by size and a sampled fingerprint, and a hit is only used after the full xxh64 matches too.
+class ZDigestStore
+{
+public:
+	ZDigestStore();
+
+public:
+	static ZDigestStore &Shared();
+
+public:
+	bool Open(const char *szFile);
+	bool Save();
+	bool IsOpened();
+	bool SHASum(const uint8_t *pData, size_t sSize, string &strSHA1, string &strSHA256);
+	bool SHASumFile(int fd, uint64_t uSize, string &strSHA1, string &strSHA256);
+	void PrintStats();
+
+private:
+	uint64_t GetSampleFingerprint(const uint8_t *pData, size_t sSize);
+	bool GetSampleFingerprint(int fd, uint64_t uSize, uint64_t &uSample);
+	bool HasCandidate(const pair<uint64_t, uint64_t> &key);
+	bool FindRecord(const pair<uint64_t, uint64_t> &key, uint64_t uFull, string &strSHA1, string &strSHA256);
+	bool AddRecord(const pair<uint64_t, uint64_t> &key, uint64_t uFull, const string &strSHA1, const string &strSHA256);
+
+private:
+	string m_strFile;
+	bool m_bOpened;
+	bool m_bChanged;
+	mutex m_mutex;
+	multimap<pair<uint64_t, uint64_t>, ZDigestRecord> m_mapRecords;
+	atomic<uint32_t> m_uHits;
+	atomic<uint32_t> m_uMisses;
+	atomic<uint32_t> m_uConflicts;
+	atomic<uint64_t> m_uSavedBytes;
+};
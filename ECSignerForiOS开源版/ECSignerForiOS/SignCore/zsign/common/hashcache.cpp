@@ -0,0 +1,268 @@
+#include "hashcache.h"
+#include "base64.h"
+#include <algorithm>
+
+#define FILE_HASH_CACHE_MAGIC 0x4348465a //ZFHC
+#define FILE_HASH_CACHE_VERSION 1
+#define FILE_HASH_CACHE_MAX_ENTRIES 262144
+#define FILE_HASH_CACHE_RACY_NS 1000000000LL
+
+#if defined(__APPLE__)
+#define STAT_MTIME_NS(st) ((int64_t)(st).st_mtimespec.tv_sec * 1000000000LL + (st).st_mtimespec.tv_nsec)
+#define STAT_CTIME_NS(st) ((int64_t)(st).st_ctimespec.tv_sec * 1000000000LL + (st).st_ctimespec.tv_nsec)
+#else
+#define STAT_MTIME_NS(st) ((int64_t)(st).st_mtim.tv_sec * 1000000000LL + (st).st_mtim.tv_nsec)
+#define STAT_CTIME_NS(st) ((int64_t)(st).st_ctim.tv_sec * 1000000000LL + (st).st_ctim.tv_nsec)
+#endif
+
+static bool FileHashEntryLess(const ZFileHashEntry &a, const ZFileHashEntry &b)
+{
+	return (a.dev != b.dev) ? (a.dev < b.dev) : (a.ino < b.ino);
+}
+
+static bool IsSameStat(const struct stat &st1, const struct stat &st2)
+{
+	return (st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino && st1.st_size == st2.st_size && STAT_MTIME_NS(st1) == STAT_MTIME_NS(st2) && STAT_CTIME_NS(st1) == STAT_CTIME_NS(st2));
+}
+
+ZFileHashCache::ZFileHashCache()
+{
+	m_pBase = NULL;
+	m_sSize = 0;
+	m_pEntries = NULL;
+	m_uCount = 0;
+	m_uHits = 0;
+	m_uMisses = 0;
+}
+
+ZFileHashCache::~ZFileHashCache()
+{
+	Close();
+}
+
+bool ZFileHashCache::Open(const char *szFile)
+{
+	Close();
+	m_strFile = szFile;
+
+	m_pBase = (uint8_t *)MapFile(szFile, 0, 0, &m_sSize, true);
+	if (NULL == m_pBase)
+	{ //new cache
+		m_sSize = 0;
+		return true;
+	}
+
+	ZFileHashHeader *pHeader = (ZFileHashHeader *)m_pBase;
+	if (m_sSize < sizeof(ZFileHashHeader) || FILE_HASH_CACHE_MAGIC != pHeader->magic || FILE_HASH_CACHE_VERSION != pHeader->version || sizeof(ZFileHashEntry) != pHeader->entrysize || m_sSize != sizeof(ZFileHashHeader) + (size_t)pHeader->count * sizeof(ZFileHashEntry))
+	{
+		ZLog::WarnV(">>> Invalid File Hash Cache, Ignored! %s\n", szFile);
+		munmap(m_pBase, m_sSize);
+		m_pBase = NULL;
+		m_sSize = 0;
+		return true;
+	}
+
+	m_pEntries = (const ZFileHashEntry *)(m_pBase + sizeof(ZFileHashHeader));
+	m_uCount = pHeader->count;
+	m_pUsed.reset(new atomic<uint8_t>[m_uCount]);
+	for (uint32_t i = 0; i < m_uCount; i++)
+	{
+		m_pUsed[i] = 0;
+	}
+	return true;
+}
+
+void ZFileHashCache::Close()
+{
+	if (NULL != m_pBase)
+	{
+		munmap(m_pBase, m_sSize);
+	}
+	m_pBase = NULL;
+	m_sSize = 0;
+	m_pEntries = NULL;
+	m_uCount = 0;
+	m_pUsed.reset();
+	m_arrPending.clear();
+	m_strFile.clear();
+}
+
+bool ZFileHashCache::IsOpened()
+{
+	return !m_strFile.empty();
+}
+
+const ZFileHashEntry *ZFileHashCache::Find(const struct stat &st)
+{
+	ZFileHashEntry key;
+	key.dev = (uint64_t)st.st_dev;
+	key.ino = (uint64_t)st.st_ino;
+	const ZFileHashEntry *pEnd = m_pEntries + m_uCount;
+	const ZFileHashEntry *pEntry = lower_bound(m_pEntries, pEnd, key, FileHashEntryLess);
+	if (pEntry == pEnd || pEntry->dev != key.dev || pEntry->ino != key.ino)
+	{
+		return NULL;
+	}
+
+	m_pUsed[pEntry - m_pEntries] = 1;
+	if (pEntry->size != (uint64_t)st.st_size || pEntry->mtime != STAT_MTIME_NS(st) || pEntry->ctime != STAT_CTIME_NS(st))
+	{ //changed
+		return NULL;
+	}
+	return pEntry;
+}
+
+void ZFileHashCache::Insert(const struct stat &st, const string &strSHA1, const string &strSHA256)
+{
+	ZFileHashEntry entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.dev = (uint64_t)st.st_dev;
+	entry.ino = (uint64_t)st.st_ino;
+	entry.size = (uint64_t)st.st_size;
+	entry.mtime = STAT_MTIME_NS(st);
+	entry.ctime = STAT_CTIME_NS(st);
+	memcpy(entry.sha1, strSHA1.data(), sizeof(entry.sha1));
+	memcpy(entry.sha256, strSHA256.data(), sizeof(entry.sha256));
+
+	lock_guard<mutex> lock(m_mutex);
+	m_arrPending.push_back(entry);
+}
+
+bool ZFileHashCache::SHASumFile(const char *szFile, string &strSHA1, string &strSHA256)
+{
+	struct stat st;
+	if (!IsOpened() || 0 != stat(szFile, &st) || !S_ISREG(st.st_mode))
+	{
+		return ::SHASumFile(szFile, strSHA1, strSHA256);
+	}
+
+	const ZFileHashEntry *pEntry = Find(st);
+	if (NULL != pEntry)
+	{
+		m_uHits++;
+		strSHA1.assign((const char *)pEntry->sha1, sizeof(pEntry->sha1));
+		strSHA256.assign((const char *)pEntry->sha256, sizeof(pEntry->sha256));
+		return true;
+	}
+
+	m_uMisses++;
+	if (!::SHASumFile(szFile, strSHA1, strSHA256) || 20 != strSHA1.size() || 32 != strSHA256.size())
+	{
+		return false;
+	}
+
+	//skip files changed while hashing, or so recently that a later write could keep the same timestamps
+	struct stat st2;
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	int64_t nNow = (int64_t)tv.tv_sec * 1000000000LL + (int64_t)tv.tv_usec * 1000;
+	if (0 == stat(szFile, &st2) && IsSameStat(st, st2) && nNow - max(STAT_MTIME_NS(st), STAT_CTIME_NS(st)) > FILE_HASH_CACHE_RACY_NS)
+	{
+		Insert(st, strSHA1, strSHA256);
+	}
+	return true;
+}
+
+bool ZFileHashCache::SHASumBase64File(const char *szFile, string &strSHA1Base64, string &strSHA256Base64)
+{
+	ZBase64 b64;
+	string strSHA1;
+	string strSHA256;
+	SHASumFile(szFile, strSHA1, strSHA256);
+	strSHA1Base64 = b64.Encode(strSHA1);
+	strSHA256Base64 = b64.Encode(strSHA256);
+	return (!strSHA1Base64.empty() && !strSHA256Base64.empty());
+}
+
+bool ZFileHashCache::Save()
+{
+	if (!IsOpened())
+	{
+		return false;
+	}
+
+	vector<ZFileHashEntry> arrEntries;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		if (m_arrPending.empty())
+		{
+			return true;
+		}
+		arrEntries = m_arrPending;
+	}
+	stable_sort(arrEntries.begin(), arrEntries.end(), FileHashEntryLess);
+
+	//newer entries replace old ones of the same file, unused entries are dropped when the cache is full
+	bool bPrune = (m_uCount + arrEntries.size() > FILE_HASH_CACHE_MAX_ENTRIES);
+	vector<ZFileHashEntry> arrMerged;
+	arrMerged.reserve(m_uCount + arrEntries.size());
+	size_t j = 0;
+	for (uint32_t i = 0; i < m_uCount; i++)
+	{
+		const ZFileHashEntry &entry = m_pEntries[i];
+		while (j < arrEntries.size() && FileHashEntryLess(arrEntries[j], entry))
+		{
+			arrMerged.push_back(arrEntries[j++]);
+		}
+		if (j < arrEntries.size() && !FileHashEntryLess(entry, arrEntries[j]))
+		{
+			continue;
+		}
+		if (!bPrune || 0 != m_pUsed[i])
+		{
+			arrMerged.push_back(entry);
+		}
+	}
+	for (; j < arrEntries.size(); j++)
+	{
+		arrMerged.push_back(arrEntries[j]);
+	}
+
+	//keep the last one of duplicated pending entries
+	vector<ZFileHashEntry> arrOutput;
+	arrOutput.reserve(arrMerged.size());
+	for (size_t i = 0; i < arrMerged.size(); i++)
+	{
+		if (!arrOutput.empty() && !FileHashEntryLess(arrOutput.back(), arrMerged[i]))
+		{
+			arrOutput.back() = arrMerged[i];
+		}
+		else
+		{
+			arrOutput.push_back(arrMerged[i]);
+		}
+	}
+	if (arrOutput.size() > FILE_HASH_CACHE_MAX_ENTRIES)
+	{
+		arrOutput.resize(FILE_HASH_CACHE_MAX_ENTRIES);
+	}
+
+	ZFileHashHeader header;
+	header.magic = FILE_HASH_CACHE_MAGIC;
+	header.version = FILE_HASH_CACHE_VERSION;
+	header.count = (uint32_t)arrOutput.size();
+	header.entrysize = sizeof(ZFileHashEntry);
+
+	string strData;
+	strData.reserve(sizeof(header) + arrOutput.size() * sizeof(ZFileHashEntry));
+	strData.append((const char *)&header, sizeof(header));
+	strData.append((const char *)arrOutput.data(), arrOutput.size() * sizeof(ZFileHashEntry));
+
+	//readers may still map the old file, replace it atomically
+	string strTempFile;
+	StringFormat(strTempFile, "%s.%d.tmp", m_strFile.c_str(), (int)getpid());
+	if (!WriteFile(strTempFile.c_str(), strData) || 0 != rename(strTempFile.c_str(), m_strFile.c_str()))
+	{
+		RemoveFile(strTempFile.c_str());
+		ZLog::WarnV(">>> Save File Hash Cache Failed! %s\n", m_strFile.c_str());
+		return false;
+	}
+	return true;
+}
+
+void ZFileHashCache::PrintStats()
+{
+	uint32_t uHits = m_uHits;
+	uint32_t uMisses = m_uMisses;
+	ZLog::PrintV(">>> HashCache: \t%u hits, %u misses\n", uHits, uMisses);
+}
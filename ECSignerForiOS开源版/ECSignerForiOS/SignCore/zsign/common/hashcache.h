@@ -0,0 +1,61 @@
+#pragma once
+#include "common.h"
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+#pragma pack(push, 1)
+struct ZFileHashEntry
+{
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;	//ns
+	int64_t ctime;	//ns
+	uint8_t sha1[20];
+	uint8_t sha256[32];
+	uint32_t reserved;
+};
+
+struct ZFileHashHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint32_t entrysize;
+};
+#pragma pack(pop)
+
+//persistent sha1/sha256 cache of files, keyed by (dev, ino) and validated by size, mtime and ctime.
+//the saved table is mapped read only and sorted, so lookups need no lock, new entries are kept aside until Save.
+class ZFileHashCache
+{
+public:
+	ZFileHashCache();
+	~ZFileHashCache();
+
+public:
+	bool Open(const char *szFile);
+	bool Save();
+	void Close();
+	bool IsOpened();
+	bool SHASumFile(const char *szFile, string &strSHA1, string &strSHA256);
+	bool SHASumBase64File(const char *szFile, string &strSHA1Base64, string &strSHA256Base64);
+	void PrintStats();
+
+private:
+	const ZFileHashEntry *Find(const struct stat &st);
+	void Insert(const struct stat &st, const string &strSHA1, const string &strSHA256);
+
+private:
+	string m_strFile;
+	uint8_t *m_pBase;
+	size_t m_sSize;
+	const ZFileHashEntry *m_pEntries;
+	uint32_t m_uCount;
+	unique_ptr<atomic<uint8_t>[]> m_pUsed;
+	mutex m_mutex;
+	vector<ZFileHashEntry> m_arrPending;
+	atomic<uint32_t> m_uHits;
+	atomic<uint32_t> m_uMisses;
+};
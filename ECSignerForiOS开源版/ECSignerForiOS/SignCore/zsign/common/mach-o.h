@@ -446,6 +446,12 @@ struct dylib_command {
 	struct dylib	dylib;		/* the library identification */
 };
 
+struct rpath_command {
+	uint32_t		cmd;		/* LC_RPATH */
+	uint32_t		cmdsize;	/* includes string */
+	union lc_str	path;		/* path to add to run path */
+};
+
 #pragma pack(pop)
 
 //////CodeSignature
@@ -0,0 +1,331 @@
+#include "common.h"
+#include <openssl/sha.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SHA_BATCH_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define SHA_BATCH_LANES 8
+
+static const uint32_t g_uSHA256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint32_t g_uSHA256H[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+static const uint32_t g_uSHA1H[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+
+//build the padded tail blocks (1 or 2) for a message of sSize bytes
+static uint32_t SHABuildTail(const uint8_t *pData, size_t sSize, uint8_t *pTail)
+{
+	size_t sRemain = sSize % 64;
+	uint32_t uTailBlocks = (sRemain < 56) ? 1 : 2;
+	memset(pTail, 0, 128);
+	memcpy(pTail, pData + (sSize - sRemain), sRemain);
+	pTail[sRemain] = 0x80;
+	uint64_t uBits = (uint64_t)sSize * 8;
+	for (int i = 0; i < 8; i++)
+	{
+		pTail[uTailBlocks * 64 - 1 - i] = (uint8_t)(uBits >> (i * 8));
+	}
+	return uTailBlocks;
+}
+
+#if defined(SHA_BATCH_X86)
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+AVX2_TARGET static inline __m256i Rotr32x8(__m256i x, int n)
+{
+	return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+AVX2_TARGET static inline __m256i Rotl32x8(__m256i x, int n)
+{
+	return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n));
+}
+
+//load 32 bytes from each lane and transpose, so that out[i] holds big-endian word i of every lane
+AVX2_TARGET static inline void LoadWords32x8(const uint8_t *ppLanes[SHA_BATCH_LANES], size_t sOffset, __m256i out[8])
+{
+	const __m256i vSwap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+										   3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	__m256i r[8];
+	for (int i = 0; i < 8; i++)
+	{
+		r[i] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(ppLanes[i] + sOffset)), vSwap);
+	}
+
+	__m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+	__m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+	__m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+	__m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+	__m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+	__m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+	__m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+	__m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+	__m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+	__m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+	__m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+	__m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+	__m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+	__m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+	__m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+	__m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+	out[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+	out[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+	out[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+	out[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+	out[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+	out[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+	out[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+	out[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+AVX2_TARGET static void SHA256Blocks32x8(__m256i state[8], const uint8_t *ppLanes[SHA_BATCH_LANES], size_t sBlocks)
+{
+	for (size_t sBlock = 0; sBlock < sBlocks; sBlock++)
+	{
+		__m256i w[16];
+		LoadWords32x8(ppLanes, sBlock * 64, w);
+		LoadWords32x8(ppLanes, sBlock * 64 + 32, w + 8);
+
+		__m256i a = state[0], b = state[1], c = state[2], d = state[3];
+		__m256i e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int t = 0; t < 64; t++)
+		{
+			if (t >= 16)
+			{
+				__m256i w15 = w[(t - 15) & 15];
+				__m256i w2 = w[(t - 2) & 15];
+				__m256i s0 = _mm256_xor_si256(_mm256_xor_si256(Rotr32x8(w15, 7), Rotr32x8(w15, 18)), _mm256_srli_epi32(w15, 3));
+				__m256i s1 = _mm256_xor_si256(_mm256_xor_si256(Rotr32x8(w2, 17), Rotr32x8(w2, 19)), _mm256_srli_epi32(w2, 10));
+				w[t & 15] = _mm256_add_epi32(_mm256_add_epi32(w[t & 15], s0), _mm256_add_epi32(w[(t - 7) & 15], s1));
+			}
+
+			__m256i S1 = _mm256_xor_si256(_mm256_xor_si256(Rotr32x8(e, 6), Rotr32x8(e, 11)), Rotr32x8(e, 25));
+			__m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+			__m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, S1), _mm256_add_epi32(ch, _mm256_add_epi32(_mm256_set1_epi32((int)g_uSHA256K[t]), w[t & 15])));
+			__m256i S0 = _mm256_xor_si256(_mm256_xor_si256(Rotr32x8(a, 2), Rotr32x8(a, 13)), Rotr32x8(a, 22));
+			__m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+			__m256i t2 = _mm256_add_epi32(S0, maj);
+
+			h = g;
+			g = f;
+			f = e;
+			e = _mm256_add_epi32(d, t1);
+			d = c;
+			c = b;
+			b = a;
+			a = _mm256_add_epi32(t1, t2);
+		}
+
+		state[0] = _mm256_add_epi32(state[0], a);
+		state[1] = _mm256_add_epi32(state[1], b);
+		state[2] = _mm256_add_epi32(state[2], c);
+		state[3] = _mm256_add_epi32(state[3], d);
+		state[4] = _mm256_add_epi32(state[4], e);
+		state[5] = _mm256_add_epi32(state[5], f);
+		state[6] = _mm256_add_epi32(state[6], g);
+		state[7] = _mm256_add_epi32(state[7], h);
+	}
+}
+
+AVX2_TARGET static void SHA1Blocks32x8(__m256i state[5], const uint8_t *ppLanes[SHA_BATCH_LANES], size_t sBlocks)
+{
+	for (size_t sBlock = 0; sBlock < sBlocks; sBlock++)
+	{
+		__m256i w[16];
+		LoadWords32x8(ppLanes, sBlock * 64, w);
+		LoadWords32x8(ppLanes, sBlock * 64 + 32, w + 8);
+
+		__m256i a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+		for (int t = 0; t < 80; t++)
+		{
+			if (t >= 16)
+			{
+				__m256i x = _mm256_xor_si256(_mm256_xor_si256(w[(t - 3) & 15], w[(t - 8) & 15]), _mm256_xor_si256(w[(t - 14) & 15], w[t & 15]));
+				w[t & 15] = Rotl32x8(x, 1);
+			}
+
+			__m256i f, k;
+			if (t < 20)
+			{
+				f = _mm256_xor_si256(_mm256_and_si256(b, c), _mm256_andnot_si256(b, d));
+				k = _mm256_set1_epi32(0x5a827999);
+			}
+			else if (t < 40)
+			{
+				f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+				k = _mm256_set1_epi32(0x6ed9eba1);
+			}
+			else if (t < 60)
+			{
+				f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+				k = _mm256_set1_epi32((int)0x8f1bbcdc);
+			}
+			else
+			{
+				f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+				k = _mm256_set1_epi32((int)0xca62c1d6);
+			}
+
+			__m256i tmp = _mm256_add_epi32(_mm256_add_epi32(Rotl32x8(a, 5), f), _mm256_add_epi32(_mm256_add_epi32(e, k), w[t & 15]));
+			e = d;
+			d = c;
+			c = Rotl32x8(b, 30);
+			b = a;
+			a = tmp;
+		}
+
+		state[0] = _mm256_add_epi32(state[0], a);
+		state[1] = _mm256_add_epi32(state[1], b);
+		state[2] = _mm256_add_epi32(state[2], c);
+		state[3] = _mm256_add_epi32(state[3], d);
+		state[4] = _mm256_add_epi32(state[4], e);
+	}
+}
+
+//hash up to 8 equally sized buffers at once
+AVX2_TARGET static void SHASumLanesAVX2(int nSumType, const uint8_t *ppData[SHA_BATCH_LANES], size_t sSize, uint32_t uLanes, uint8_t *pOutput)
+{
+	uint32_t uWords = (E_SHASUM_TYPE_1 == nSumType) ? 5 : 8;
+	const uint32_t *pInit = (E_SHASUM_TYPE_1 == nSumType) ? g_uSHA1H : g_uSHA256H;
+
+	__m256i state[8];
+	for (uint32_t i = 0; i < uWords; i++)
+	{
+		state[i] = _mm256_set1_epi32((int)pInit[i]);
+	}
+
+	const uint8_t *ppLanes[SHA_BATCH_LANES];
+	for (uint32_t i = 0; i < SHA_BATCH_LANES; i++)
+	{
+		ppLanes[i] = ppData[(i < uLanes) ? i : 0];
+	}
+
+	size_t sBlocks = sSize / 64;
+	if (E_SHASUM_TYPE_1 == nSumType)
+	{
+		SHA1Blocks32x8(state, ppLanes, sBlocks);
+	}
+	else
+	{
+		SHA256Blocks32x8(state, ppLanes, sBlocks);
+	}
+
+	uint8_t tails[SHA_BATCH_LANES][128];
+	uint32_t uTailBlocks = 0;
+	for (uint32_t i = 0; i < SHA_BATCH_LANES; i++)
+	{
+		uTailBlocks = SHABuildTail(ppLanes[i], sSize, tails[i]);
+		ppLanes[i] = tails[i];
+	}
+	if (E_SHASUM_TYPE_1 == nSumType)
+	{
+		SHA1Blocks32x8(state, ppLanes, uTailBlocks);
+	}
+	else
+	{
+		SHA256Blocks32x8(state, ppLanes, uTailBlocks);
+	}
+
+	uint32_t uHashSize = uWords * 4;
+	uint32_t words[8][SHA_BATCH_LANES];
+	for (uint32_t i = 0; i < uWords; i++)
+	{
+		_mm256_storeu_si256((__m256i *)words[i], state[i]);
+	}
+	for (uint32_t l = 0; l < uLanes; l++)
+	{
+		uint8_t *pHash = pOutput + uHashSize * l;
+		for (uint32_t i = 0; i < uWords; i++)
+		{
+			pHash[i * 4] = (uint8_t)(words[i][l] >> 24);
+			pHash[i * 4 + 1] = (uint8_t)(words[i][l] >> 16);
+			pHash[i * 4 + 2] = (uint8_t)(words[i][l] >> 8);
+			pHash[i * 4 + 3] = (uint8_t)(words[i][l]);
+		}
+	}
+}
+
+#endif
+
+static int DetectSHABackend()
+{
+#if defined(SHA_BATCH_X86)
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+	{
+		if (ebx & (1 << 29))
+		{ //openssl uses sha-ni for single buffers, which beats any multi-buffer kernel
+			return E_SHA_BACKEND_SHANI;
+		}
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return E_SHA_BACKEND_AVX2;
+	}
+#elif defined(__aarch64__) || defined(__arm64__)
+	return E_SHA_BACKEND_ARMV8; //openssl uses the armv8 crypto extensions
+#endif
+	return E_SHA_BACKEND_SCALAR;
+}
+
+int GetSHABackend()
+{
+	static int s_nBackend = DetectSHABackend();
+	return s_nBackend;
+}
+
+const char *GetSHABackendName()
+{
+	switch (GetSHABackend())
+	{
+	case E_SHA_BACKEND_SHANI:
+		return "sha-ni";
+	case E_SHA_BACKEND_AVX2:
+		return "avx2 x8";
+	case E_SHA_BACKEND_ARMV8:
+		return "armv8-ce";
+	}
+	return "scalar";
+}
+
+bool SHASumBatch(int nSumType, const uint8_t *pData, size_t sSize, uint32_t uCount, uint8_t *pOutput)
+{
+	uint32_t uHashSize = (E_SHASUM_TYPE_1 == nSumType) ? 20 : 32;
+	uint32_t i = 0;
+
+#if defined(SHA_BATCH_X86)
+	if (E_SHA_BACKEND_AVX2 == GetSHABackend())
+	{
+		const uint8_t *ppLanes[SHA_BATCH_LANES];
+		for (; i + 1 < uCount; i += SHA_BATCH_LANES)
+		{
+			uint32_t uLanes = (uCount - i < SHA_BATCH_LANES) ? (uCount - i) : SHA_BATCH_LANES;
+			for (uint32_t l = 0; l < uLanes; l++)
+			{
+				ppLanes[l] = pData + sSize * (i + l);
+			}
+			SHASumLanesAVX2(nSumType, ppLanes, sSize, uLanes, pOutput + uHashSize * i);
+		}
+	}
+#endif
+
+	for (; i < uCount; i++)
+	{
+		SHASum(nSumType, pData + sSize * i, sSize, pOutput + uHashSize * i);
+	}
+	return true;
+}
@@ -0,0 +1,276 @@
+#include "filetree.h"
+
+static uint8_t GetBundleKind(const char *szName)
+{
+	string strName = szName;
+	if (IsPathSuffix(strName, ".app"))
+	{
+		return E_BUNDLE_APP;
+	}
+	else if (IsPathSuffix(strName, ".appex"))
+	{
+		return E_BUNDLE_APPEX;
+	}
+	else if (IsPathSuffix(strName, ".framework"))
+	{
+		return E_BUNDLE_FRAMEWORK;
+	}
+	else if (IsPathSuffix(strName, ".xctest"))
+	{
+		return E_BUNDLE_XCTEST;
+	}
+	return E_BUNDLE_NONE;
+}
+
+static uint8_t GetStatType(const struct stat &st)
+{
+	if (S_ISDIR(st.st_mode))
+	{
+		return DT_DIR;
+	}
+	else if (S_ISREG(st.st_mode))
+	{
+		return DT_REG;
+	}
+	else if (S_ISLNK(st.st_mode))
+	{
+		return DT_LNK;
+	}
+	return DT_UNKNOWN;
+}
+
+ZFileTree::ZFileTree()
+{
+}
+
+bool ZFileTree::Scan(const string &strRoot)
+{
+	m_strRoot = strRoot;
+	while (m_strRoot.size() > 1 && '/' == m_strRoot[m_strRoot.size() - 1])
+	{
+		m_strRoot.erase(m_strRoot.size() - 1);
+	}
+	m_arrEntries.clear();
+
+	int fd = open(m_strRoot.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0)
+	{
+		ZLog::ErrorV(">>> Can't Open Folder! %s, %s\n", m_strRoot.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+	AddEntry(FILE_TREE_NONE, basename((char *)m_strRoot.c_str()), DT_DIR, &st);
+	ScanFolder(fd, 0);
+	return true;
+}
+
+bool ZFileTree::IsScanned()
+{
+	return !m_arrEntries.empty();
+}
+
+void ZFileTree::ScanFolder(int fd, uint32_t uFolder)
+{
+	DIR *dir = fdopendir(fd);
+	if (NULL == dir)
+	{
+		close(fd);
+		return;
+	}
+
+	int dfd = dirfd(dir);
+	vector<uint32_t> arrSubFolders;
+	dirent *ptr = readdir(dir);
+	while (NULL != ptr)
+	{
+		if (0 != strcmp(ptr->d_name, ".") && 0 != strcmp(ptr->d_name, ".."))
+		{
+			struct stat st;
+			bool bStat = (0 == fstatat(dfd, ptr->d_name, &st, AT_SYMLINK_NOFOLLOW));
+			uint8_t uType = ptr->d_type;
+			if (DT_UNKNOWN == uType && bStat)
+			{
+				uType = GetStatType(st);
+			}
+
+			uint32_t uIndex = AddEntry(uFolder, ptr->d_name, uType, bStat ? &st : NULL);
+			if (DT_DIR == uType)
+			{
+				arrSubFolders.push_back(uIndex);
+			}
+		}
+		ptr = readdir(dir);
+	}
+
+	for (size_t i = 0; i < arrSubFolders.size(); i++)
+	{
+		int subfd = openat(dfd, m_arrEntries[arrSubFolders[i]].strName.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (subfd >= 0)
+		{
+			ScanFolder(subfd, arrSubFolders[i]);
+		}
+	}
+	closedir(dir);
+}
+
+uint32_t ZFileTree::AddEntry(uint32_t uParent, const char *szName, uint8_t uType, const struct stat *pst)
+{
+	ZFileEntry entry;
+	entry.strName = szName;
+	entry.uType = uType;
+	entry.uBundleKind = (DT_DIR == uType) ? GetBundleKind(szName) : (uint8_t)E_BUNDLE_NONE;
+	entry.nSize = (NULL != pst) ? (int64_t)pst->st_size : 0;
+	entry.nMTime = (NULL != pst) ? (int64_t)pst->st_mtime : 0;
+	entry.uInode = (NULL != pst) ? (uint64_t)pst->st_ino : 0;
+	entry.uParent = uParent;
+	entry.uFirstChild = FILE_TREE_NONE;
+	entry.uLastChild = FILE_TREE_NONE;
+	entry.uNextSibling = FILE_TREE_NONE;
+
+	uint32_t uIndex = (uint32_t)m_arrEntries.size();
+	m_arrEntries.push_back(entry);
+	if (FILE_TREE_NONE != uParent)
+	{ //keep readdir order
+		ZFileEntry &parent = m_arrEntries[uParent];
+		if (FILE_TREE_NONE == parent.uLastChild)
+		{
+			parent.uFirstChild = uIndex;
+		}
+		else
+		{
+			m_arrEntries[parent.uLastChild].uNextSibling = uIndex;
+		}
+		parent.uLastChild = uIndex;
+	}
+	return uIndex;
+}
+
+uint32_t ZFileTree::Find(const string &strPath)
+{
+	lock_guard<mutex> lock(m_mutex);
+	if (m_arrEntries.empty())
+	{
+		return FILE_TREE_NONE;
+	}
+	if (strPath == m_strRoot)
+	{
+		return 0;
+	}
+	if (0 != strPath.compare(0, m_strRoot.size() + 1, m_strRoot + "/"))
+	{
+		return FILE_TREE_NONE;
+	}
+
+	vector<string> arrNames;
+	StringSplit(strPath.substr(m_strRoot.size() + 1), "/", arrNames);
+	uint32_t uIndex = 0;
+	for (size_t i = 0; i < arrNames.size() && FILE_TREE_NONE != uIndex; i++)
+	{
+		if (arrNames[i].empty())
+		{
+			continue;
+		}
+		uint32_t uChild = m_arrEntries[uIndex].uFirstChild;
+		while (FILE_TREE_NONE != uChild && m_arrEntries[uChild].strName != arrNames[i])
+		{
+			uChild = m_arrEntries[uChild].uNextSibling;
+		}
+		uIndex = uChild;
+	}
+	return uIndex;
+}
+
+uint32_t ZFileTree::Update(const string &strPath)
+{
+	lock_guard<mutex> lock(m_mutex);
+	if (m_arrEntries.empty() || 0 != strPath.compare(0, m_strRoot.size() + 1, m_strRoot + "/"))
+	{
+		return FILE_TREE_NONE;
+	}
+
+	//add the missing entries along the path, then refresh the last one
+	vector<string> arrNames;
+	StringSplit(strPath.substr(m_strRoot.size() + 1), "/", arrNames);
+	string strCurrent = m_strRoot;
+	uint32_t uIndex = 0;
+	for (size_t i = 0; i < arrNames.size(); i++)
+	{
+		if (arrNames[i].empty())
+		{
+			continue;
+		}
+		strCurrent += "/";
+		strCurrent += arrNames[i];
+
+		struct stat st;
+		if (0 != lstat(strCurrent.c_str(), &st))
+		{
+			return FILE_TREE_NONE;
+		}
+
+		uint32_t uChild = m_arrEntries[uIndex].uFirstChild;
+		while (FILE_TREE_NONE != uChild && m_arrEntries[uChild].strName != arrNames[i])
+		{
+			uChild = m_arrEntries[uChild].uNextSibling;
+		}
+
+		if (FILE_TREE_NONE == uChild)
+		{
+			uChild = AddEntry(uIndex, arrNames[i].c_str(), GetStatType(st), &st);
+		}
+		else
+		{
+			ZFileEntry &entry = m_arrEntries[uChild];
+			entry.uType = GetStatType(st);
+			entry.nSize = st.st_size;
+			entry.nMTime = st.st_mtime;
+			entry.uInode = st.st_ino;
+		}
+		uIndex = uChild;
+	}
+	return uIndex;
+}
+
+string ZFileTree::GetPath(uint32_t uIndex)
+{
+	lock_guard<mutex> lock(m_mutex);
+	string strPath;
+	while (uIndex < m_arrEntries.size() && 0 != uIndex)
+	{
+		strPath = "/" + m_arrEntries[uIndex].strName + strPath;
+		uIndex = m_arrEntries[uIndex].uParent;
+	}
+	return m_strRoot + strPath;
+}
+
+const ZFileEntry &ZFileTree::GetEntry(uint32_t uIndex)
+{
+	return m_arrEntries[uIndex];
+}
+
+void ZFileTree::GetFiles(uint32_t uFolder, map<string, int64_t> &mapFiles)
+{
+	lock_guard<mutex> lock(m_mutex);
+	if (uFolder < m_arrEntries.size())
+	{
+		GetFiles(uFolder, "", mapFiles);
+	}
+}
+
+void ZFileTree::GetFiles(uint32_t uFolder, const string &strPrefix, map<string, int64_t> &mapFiles)
+{
+	for (uint32_t uChild = m_arrEntries[uFolder].uFirstChild; FILE_TREE_NONE != uChild; uChild = m_arrEntries[uChild].uNextSibling)
+	{
+		const ZFileEntry &entry = m_arrEntries[uChild];
+		if (DT_DIR == entry.uType)
+		{
+			GetFiles(uChild, strPrefix + entry.strName + "/", mapFiles);
+		}
+		else if (DT_REG == entry.uType)
+		{
+			mapFiles[strPrefix + entry.strName] = entry.nSize;
+		}
+	}
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "common/common.h"
+
+#define FILE_TREE_NONE 0xFFFFFFFF
+
+enum
+{
+	E_BUNDLE_NONE = 0,
+	E_BUNDLE_APP = 1,
+	E_BUNDLE_APPEX = 2,
+	E_BUNDLE_FRAMEWORK = 3,
+	E_BUNDLE_XCTEST = 4,
+};
+
+struct ZFileEntry
+{
+	string strName;
+	uint8_t uType;		 //DT_DIR, DT_REG, DT_LNK...
+	uint8_t uBundleKind; //E_BUNDLE_*
+	int64_t nSize;
+	int64_t nMTime;
+	uint64_t uInode;
+	uint32_t uParent;
+	uint32_t uFirstChild;
+	uint32_t uLastChild;
+	uint32_t uNextSibling;
+};
+
+//the bundle is walked once, later stages query the tree instead of the file system.
+//files written while signing must be passed to Update, so the tree keeps matching the disk.
+//Find, Update, GetPath and GetFiles may run on several threads, GetEntry is only safe while nothing is updated.
+class ZFileTree
+{
+public:
+	ZFileTree();
+
+public:
+	bool Scan(const string &strRoot);
+	bool IsScanned();
+	uint32_t Find(const string &strPath);
+	uint32_t Update(const string &strPath);
+	string GetPath(uint32_t uIndex);
+	const ZFileEntry &GetEntry(uint32_t uIndex);
+	void GetFiles(uint32_t uFolder, map<string, int64_t> &mapFiles);
+
+private:
+	void ScanFolder(int fd, uint32_t uFolder);
+	uint32_t AddEntry(uint32_t uParent, const char *szName, uint8_t uType, const struct stat *pst);
+	void GetFiles(uint32_t uFolder, const string &strPrefix, map<string, int64_t> &mapFiles);
+
+private:
+	string m_strRoot;
+	mutex m_mutex;
+	vector<ZFileEntry> m_arrEntries;
+};
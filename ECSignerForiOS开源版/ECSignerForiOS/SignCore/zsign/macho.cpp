@@ -9,7 +9,6 @@ ZMachO::ZMachO()
 {
 	m_pBase = NULL;
 	m_sSize = 0;
-	m_bCSRealloced = false;
 }
 
 ZMachO::~ZMachO()
@@ -36,8 +35,11 @@ bool ZMachO::InitV(const char *szFormatPath, ...)
 
 bool ZMachO::Free()
 {
+	//the slices own the dirty pages written back by CloseFile
+	bool bRet = CloseFile();
 	FreeArchOes();
-	return CloseFile();
+	m_grant.Reset(0);
+	return bRet;
 }
 
 bool ZMachO::NewArchO(uint8_t *pBase, uint32_t uLength)
@@ -45,6 +47,7 @@ bool ZMachO::NewArchO(uint8_t *pBase, uint32_t uLength)
 	ZArchO *archo = new ZArchO();
 	if (archo->Init(pBase, uLength))
 	{
+		archo->m_szFile = m_strFile.c_str();
 		m_arrArchOes.push_back(archo);
 		return true;
 	}
@@ -69,9 +72,29 @@ bool ZMachO::OpenFile(const char *szPath)
 	FreeArchOes();
 
 	m_sSize = 0;
-	m_pBase = (uint8_t *)MapFile(szPath, 0, 0, &m_sSize, false);
+	m_pBase = NULL;
+	int fd = open(szPath, O_RDONLY);
+	if (fd >= 0)
+	{ //private mapping, the file is only changed by FlushFile
+		struct stat st;
+		if (0 == fstat(fd, &st) && st.st_size > 0)
+		{
+			m_sSize = st.st_size;
+			m_pBase = (uint8_t *)mmap(NULL, m_sSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if (MAP_FAILED == m_pBase)
+			{
+				m_pBase = NULL;
+				m_sSize = 0;
+			}
+		}
+		close(fd);
+	}
+
 	if (NULL != m_pBase)
 	{
+		madvise(m_pBase, m_sSize, MADV_SEQUENTIAL);
+		madvise(m_pBase, m_sSize, MADV_WILLNEED);
+
 		uint32_t magic = *((uint32_t *)m_pBase);
 		if (FAT_CIGAM == magic || FAT_MAGIC == magic)
 		{
@@ -91,6 +114,11 @@ bool ZMachO::OpenFile(const char *szPath)
 		}
 		else if (MH_MAGIC == magic || MH_CIGAM == magic || MH_MAGIC_64 == magic || MH_CIGAM_64 == magic)
 		{
+			if (m_sSize > UINT32_MAX)
+			{ //LC_CODE_SIGNATURE can't point past 4GB
+				ZLog::ErrorV(">>> Macho File Is Too Large To Sign! %s, %llu\n", szPath, (unsigned long long)m_sSize);
+				return false;
+			}
 			if (!NewArchO(m_pBase, (uint32_t)m_sSize))
 			{
 				ZLog::ErrorV(">>> Invalid Macho File!\n");
@@ -110,6 +138,11 @@ bool ZMachO::OpenFile(const char *szPath)
 bool ZMachO::CloseFile()
 {
 	if (NULL == m_pBase || m_sSize <= 0)
+	{ //already closed, Free may follow Sign
+		return true;
+	}
+
+	if (!FlushFile())
 	{
 		return false;
 	}
@@ -119,6 +152,69 @@ bool ZMachO::CloseFile()
 		ZLog::ErrorV(">>> CodeSign Write(munmap) Failed! Error: %p, %lu, %s\n", m_pBase, m_sSize, strerror(errno));
 		return false;
 	}
+	m_pBase = NULL;
+	m_sSize = 0;
+	return true;
+}
+
+bool ZMachO::FlushFile()
+{
+	if (NULL == m_pBase)
+	{
+		return true;
+	}
+
+	//write back the changed pages of each slice, the code pages stay clean in the page cache
+	int fd = -1;
+	for (size_t i = 0; i < m_arrArchOes.size(); i++)
+	{
+		ZArchO *archo = m_arrArchOes[i];
+		uint32_t uArchOffset = (uint32_t)(archo->m_pBase - m_pBase);
+		set<uint32_t>::iterator it = archo->m_setDirtyPages.begin();
+		while (it != archo->m_setDirtyPages.end())
+		{
+			uint32_t uFirstPage = *it;
+			uint32_t uLastPage = *it;
+			for (it++; it != archo->m_setDirtyPages.end() && *it == uLastPage + 1; it++)
+			{
+				uLastPage = *it;
+			}
+
+			uint32_t uOffset = uFirstPage * CODE_PAGE_SIZE;
+			if (uOffset >= archo->m_uLength)
+			{
+				continue;
+			}
+			uint32_t uEnd = (uLastPage + 1) * CODE_PAGE_SIZE;
+			if (uEnd > archo->m_uLength)
+			{
+				uEnd = archo->m_uLength;
+			}
+
+			if (fd < 0)
+			{
+				fd = open(m_strFile.c_str(), O_WRONLY);
+				if (fd < 0)
+				{
+					ZLog::ErrorV(">>> CodeSign Write(open) Failed! %s, %s\n", m_strFile.c_str(), strerror(errno));
+					return false;
+				}
+			}
+
+			ssize_t sWritten = pwrite(fd, archo->m_pBase + uOffset, uEnd - uOffset, (off_t)uArchOffset + uOffset);
+			if (sWritten != (ssize_t)(uEnd - uOffset))
+			{
+				ZLog::ErrorV(">>> CodeSign Write(pwrite) Failed! %s, %s\n", m_strFile.c_str(), strerror(errno));
+				close(fd);
+				return false;
+			}
+		}
+	}
+
+	if (fd >= 0)
+	{
+		close(fd);
+	}
 	return true;
 }
 
@@ -138,172 +234,415 @@ bool ZMachO::Sign(ZSignAsset *pSignAsset, bool bForce, string strBundleId, strin
 		return false;
 	}
 
-	for (size_t i = 0; i < m_arrArchOes.size(); i++)
+	//all slices share the bundle id and Info.plist hashes of the first one
+	ZArchO *pFirstArchO = m_arrArchOes[0];
+	if (strBundleId.empty())
 	{
-		ZArchO *archo = m_arrArchOes[i];
+		JValue jvInfo;
+		if (pFirstArchO->m_uInfoPlistLength > 0)
+		{
+			jvInfo.readPList(pFirstArchO->m_pInfoPlist, pFirstArchO->m_uInfoPlistLength);
+		}
+		strBundleId = jvInfo["CFBundleIdentifier"].asCString();
 		if (strBundleId.empty())
 		{
-			JValue jvInfo;
-			jvInfo.readPList(archo->m_strInfoPlist);
-			strBundleId = jvInfo["CFBundleIdentifier"].asCString();
-			if (strBundleId.empty())
-			{
-				strBundleId = basename((char *)m_strFile.c_str());
-			}
+			strBundleId = basename((char *)m_strFile.c_str());
 		}
+	}
 
-		if (strInfoPlistSHA1.empty() || strInfoPlistSHA256.empty())
+	if (strInfoPlistSHA1.empty() || strInfoPlistSHA256.empty())
+	{
+		if (0 == pFirstArchO->m_uInfoPlistLength)
 		{
-			if(archo->m_strInfoPlist.empty())
-			{
-				strInfoPlistSHA1.append(20, 0);
-				strInfoPlistSHA256.append(32, 0);
-			}
-			else
+			strInfoPlistSHA1.append(20, 0);
+			strInfoPlistSHA256.append(32, 0);
+		}
+		else
+		{
+			SHASum((const uint8_t *)pFirstArchO->m_pInfoPlist, pFirstArchO->m_uInfoPlistLength, strInfoPlistSHA1, strInfoPlistSHA256);
+		}
+	}
+
+	//the whole file may become resident while it is hashed.
+	//taken here, not when the file is opened, as the bundle hashes its resources on other threads in between.
+	m_grant.Reset(m_sSize);
+
+	if (!pSignAsset->m_setThinArches.empty() && !ThinFile(pSignAsset->m_setThinArches))
+	{
+		return false;
+	}
+
+	//plan the exact signature size of every slice, so the file is grown at most once before anything is hashed
+	bool bRealloc = false;
+	vector<uint32_t> arrSignLengths;
+	for (size_t i = 0; i < m_arrArchOes.size(); i++)
+	{
+		uint32_t uSignLength = m_arrArchOes[i]->GetCodeSignatureSpace(pSignAsset, strBundleId);
+		if (!m_arrArchOes[i]->IsEnoughSpace(uSignLength))
+		{
+			bRealloc = true;
+		}
+		arrSignLengths.push_back(uSignLength);
+	}
+
+	if (bRealloc && !ReallocCodeSignSpace(arrSignLengths))
+	{
+		return false;
+	}
+
+	//each slice writes only its own range of the mapping, so they are signed concurrently
+	vector<uint8_t> arrSigned(m_arrArchOes.size(), 0);
+	ParallelFor((uint32_t)m_arrArchOes.size(), pSignAsset->m_uThreads, [&](uint32_t uBegin, uint32_t uEnd) {
+		for (uint32_t i = uBegin; i < uEnd; i++)
+		{
+			arrSigned[i] = m_arrArchOes[i]->Sign(pSignAsset, bForce, strBundleId, strInfoPlistSHA1, strInfoPlistSHA256, strCodeResourcesData) ? 1 : 0;
+		}
+	});
+
+	//the planned cms size is an estimate, slices it was too small for get one more reallocation with their real size
+	vector<uint32_t> arrRetry;
+	for (size_t i = 0; i < m_arrArchOes.size(); i++)
+	{
+		if (!arrSigned[i])
+		{
+			if (0 == m_arrArchOes[i]->m_uSignLengthNeeded)
 			{
-				SHASum(archo->m_strInfoPlist, strInfoPlistSHA1, strInfoPlistSHA256);
+				return false;
 			}
+			arrSignLengths[i] = m_arrArchOes[i]->m_uSignLengthNeeded;
+			arrRetry.push_back((uint32_t)i);
 		}
+	}
 
-		if (!archo->Sign(pSignAsset, bForce, strBundleId, strInfoPlistSHA1, strInfoPlistSHA256, strCodeResourcesData))
+	if (!arrRetry.empty())
+	{
+		if (!ReallocCodeSignSpace(arrSignLengths))
+		{
+			return false;
+		}
+		for (size_t i = 0; i < arrRetry.size(); i++)
 		{
-			if (!archo->m_bEnoughSpace && !m_bCSRealloced)
+			if (!m_arrArchOes[arrRetry[i]]->Sign(pSignAsset, bForce, strBundleId, strInfoPlistSHA1, strInfoPlistSHA256, strCodeResourcesData))
 			{
-				m_bCSRealloced = true;
-				if (ReallocCodeSignSpace())
-				{
-					return Sign(pSignAsset, bForce, strBundleId, strInfoPlistSHA1, strInfoPlistSHA256, strCodeResourcesData);
-				}
+				return false;
 			}
-			return false;
 		}
 	}
 
 	return CloseFile();
 }
 
-bool ZMachO::ReallocCodeSignSpace()
+bool ZMachO::ReallocCodeSignSpace(const vector<uint32_t> &arrSignLengths)
 {
 	ZLog::Warn(">>> Realloc CodeSignature Space... \n");
 
-	vector<uint32_t> arrMachOesSizes;
+	vector<uint32_t> arrOldOffsets;
+	vector<uint32_t> arrOldSizes;
+	vector<uint32_t> arrNewSizes;
 	for (size_t i = 0; i < m_arrArchOes.size(); i++)
 	{
-		string strNewArchOFile;
-		StringFormat(strNewArchOFile, "%s.archo.%d", m_strFile.c_str(), i);
-		uint32_t uNewLength = m_arrArchOes[i]->ReallocCodeSignSpace(strNewArchOFile);
+		ZArchO *archo = m_arrArchOes[i];
+		uint32_t uNewLength = archo->ReallocCodeSignSpace(arrSignLengths[i]);
 		if (uNewLength <= 0)
 		{
 			ZLog::Error(">>> Failed!\n");
 			return false;
 		}
-		arrMachOesSizes.push_back(uNewLength);
+		arrOldOffsets.push_back((uint32_t)(archo->m_pBase - m_pBase));
+		arrOldSizes.push_back(archo->m_uLength);
+		arrNewSizes.push_back(uNewLength);
 	}
-	ZLog::Warn(">>> Success!\n");
 
-	if (1 == m_arrArchOes.size())
+	//the file is reopened below, keep the modified pages of each arch
+	vector<set<uint32_t> > arrDirtyPages;
+	for (size_t i = 0; i < m_arrArchOes.size(); i++)
 	{
-		CloseFile();
-		RemoveFile(m_strFile.c_str());
-		string strNewArchOFile = m_strFile + ".archo.0";
-		if (0 == rename(strNewArchOFile.c_str(), m_strFile.c_str()))
-		{
-			return OpenFile(m_strFile.c_str());
-		}
+		arrDirtyPages.push_back(m_arrArchOes[i]->m_setDirtyPages);
 	}
-	else
-	{ //fat
-		uint32_t uAlign = 16384;
-		vector<fat_arch> arrArches;
-		fat_header fath = *((fat_header *)m_pBase);
+
+	//new layout, slices only move towards the end of the file
+	size_t sOldSize = m_sSize;
+	size_t sNewSize = arrNewSizes[0];
+	vector<fat_arch> arrArches;
+	vector<uint32_t> arrNewOffsets;
+	fat_header fath = *((fat_header *)m_pBase);
+	bool bFat = (FAT_MAGIC == fath.magic || FAT_CIGAM == fath.magic);
+	if (bFat)
+	{
 		int nFatArch = (FAT_MAGIC == fath.magic) ? fath.nfat_arch : LE(fath.nfat_arch);
 		for (int i = 0; i < nFatArch; i++)
 		{
 			fat_arch arch = *((fat_arch *)(m_pBase + sizeof(fat_header) + sizeof(fat_arch) * i));
 			arrArches.push_back(arch);
 		}
-		CloseFile();
 
 		if (arrArches.size() != m_arrArchOes.size())
 		{
 			return false;
 		}
 
-		uint32_t uFatHeaderSize = sizeof(fat_header) + arrArches.size() * sizeof(fat_arch);
-		uint32_t uPadding1 = (uAlign - uFatHeaderSize % uAlign);
-		uint32_t uOffset = uFatHeaderSize + uPadding1;
+		uint32_t uOffset = sizeof(fat_header) + arrArches.size() * sizeof(fat_arch);
 		for (size_t i = 0; i < arrArches.size(); i++)
 		{
-			fat_arch &arch = arrArches[i];
-			uint32_t &uMachOSize = arrMachOesSizes[i];
+			if (i > 0 && arrOldOffsets[i] < arrOldOffsets[i - 1] + arrOldSizes[i - 1])
+			{
+				ZLog::Error(">>> Unsorted Arches In Fat Macho File!\n");
+				return false;
+			}
 
-			arch.align = (FAT_MAGIC == fath.magic) ? 14 : BE((uint32_t)14);
+			//a slice stays where it is unless the one before it grew into it
+			fat_arch &arch = arrArches[i];
+			uint32_t uAlignBits = (FAT_MAGIC == fath.magic) ? arch.align : BE(arch.align);
+			uint32_t uAlign = (uAlignBits < 31) ? (1u << uAlignBits) : 16384;
+			uOffset = max(uOffset, arrOldOffsets[i]);
+			uOffset = (uOffset + uAlign - 1) / uAlign * uAlign;
 			arch.offset = (FAT_MAGIC == fath.magic) ? uOffset : BE(uOffset);
-			arch.size = (FAT_MAGIC == fath.magic) ? uMachOSize : BE(uMachOSize);
+			arch.size = (FAT_MAGIC == fath.magic) ? arrNewSizes[i] : BE(arrNewSizes[i]);
+			arrNewOffsets.push_back(uOffset);
 
-			uOffset += uMachOSize;
-			uOffset = uOffset + (uAlign - uOffset % uAlign);
+			uOffset += arrNewSizes[i];
 		}
+		sNewSize = max((size_t)uOffset, sOldSize);
+	}
+	else
+	{
+		arrNewOffsets.push_back(0);
+	}
 
-		string strNewFatMachOFile = m_strFile + ".fato";
+	if (!CloseFile())
+	{ //the patched load commands must be on disk before the slices move
+		return false;
+	}
 
-		string strFatHeader;
-		strFatHeader.append((const char *)&fath, sizeof(fat_header));
-		for (size_t i = 0; i < arrArches.size(); i++)
+	//grow in place, the new tail is a hole and reads as zeros
+	int fd = open(m_strFile.c_str(), O_RDWR);
+	if (fd < 0 || 0 != ftruncate(fd, (off_t)sNewSize))
+	{
+		ZLog::ErrorV(">>> Can't Grow File! %s, %s\n", m_strFile.c_str(), strerror(errno));
+		if (fd >= 0)
 		{
-			fat_arch &arch = arrArches[i];
-			strFatHeader.append((const char *)&arch, sizeof(fat_arch));
+			close(fd);
 		}
+		return false;
+	}
 
-		string strPadding1;
-		strPadding1.append(uPadding1, 0);
-
-		AppendFile(strNewFatMachOFile.c_str(), strFatHeader);
-		AppendFile(strNewFatMachOFile.c_str(), strPadding1);
+	if (bFat)
+	{
+		//back to front, so no slice is overwritten before it has been moved
+		bool bMoved = true;
+		for (size_t i = arrArches.size(); i > 0 && bMoved; i--)
+		{
+			bMoved = MoveFileData(fd, arrNewOffsets[i - 1], arrOldOffsets[i - 1], arrOldSizes[i - 1]);
+		}
 
-		for (size_t i = 0; i < arrArches.size(); i++)
+		//clear what is left of the old data, the rest of the file never had any
+		size_t sLiveEnd = sizeof(fat_header) + arrArches.size() * sizeof(fat_arch);
+		for (size_t i = 0; i <= arrArches.size() && sLiveEnd < sOldSize && bMoved; i++)
 		{
-			size_t sSize = 0;
-			string strNewArchOFile = m_strFile + ".archo." + JValue((int)i).asString();
-			uint8_t *pData = (uint8_t *)MapFile(strNewArchOFile.c_str(), 0, 0, &sSize, true);
-			if (NULL == pData)
+			size_t sNextLive = (i < arrArches.size()) ? arrNewOffsets[i] : sOldSize;
+			if (sNextLive > sOldSize)
 			{
-				RemoveFile(strNewFatMachOFile.c_str());
-				return false;
+				sNextLive = sOldSize;
 			}
-			string strPadding;
-			strPadding.append((uAlign - sSize % uAlign), 0);
+			if (sNextLive > sLiveEnd)
+			{
+				bMoved = ZeroFileData(fd, sLiveEnd, sNextLive - sLiveEnd);
+			}
+			if (i < arrArches.size())
+			{
+				sLiveEnd = arrNewOffsets[i] + arrOldSizes[i];
+			}
+		}
+
+		if (!bMoved || !WriteFileAt(fd, 0, &fath, sizeof(fat_header)) || !WriteFileAt(fd, sizeof(fat_header), arrArches.data(), arrArches.size() * sizeof(fat_arch)))
+		{
+			ZLog::ErrorV(">>> Can't Move Arches! %s, %s\n", m_strFile.c_str(), strerror(errno));
+			close(fd);
+			return false;
+		}
+	}
+	close(fd);
+
+	ZLog::Warn(">>> Success!\n");
+	return ReopenFile(arrDirtyPages);
+}
+
+bool ZMachO::ThinFile(const set<string> &setArches)
+{
+	fat_header fath = *((fat_header *)m_pBase);
+	if (FAT_MAGIC != fath.magic && FAT_CIGAM != fath.magic)
+	{
+		return true;
+	}
+
+	uint32_t nFatArch = (FAT_MAGIC == fath.magic) ? fath.nfat_arch : LE(fath.nfat_arch);
+	if (nFatArch != m_arrArchOes.size())
+	{
+		return false;
+	}
+
+	vector<fat_arch> arrArches;
+	vector<uint32_t> arrOldOffsets;
+	vector<uint32_t> arrSizes;
+	vector<set<uint32_t> > arrDirtyPages;
+	string strArches;
+	for (uint32_t i = 0; i < nFatArch; i++)
+	{
+		ZArchO *archo = m_arrArchOes[i];
+		if (setArches.find(archo->GetArchName()) != setArches.end())
+		{
+			arrArches.push_back(*((fat_arch *)(m_pBase + sizeof(fat_header) + sizeof(fat_arch) * i)));
+			arrOldOffsets.push_back((uint32_t)(archo->m_pBase - m_pBase));
+			arrSizes.push_back(archo->m_uLength);
+			arrDirtyPages.push_back(archo->m_setDirtyPages);
+			strArches += strArches.empty() ? "" : ",";
+			strArches += archo->GetArchName();
+		}
+	}
+
+	if (arrArches.empty())
+	{
+		ZLog::WarnV(">>> No Arch To Keep, Not Thinned! %s\n", m_strFile.c_str());
+		return true;
+	}
+	else if (arrArches.size() == nFatArch)
+	{
+		return true;
+	}
+
+	//new layout, slices only move towards the start of the file, a single slice becomes a thin file
+	bool bFat = (arrArches.size() > 1);
+	size_t sOldSize = m_sSize;
+	uint32_t uOffset = bFat ? (uint32_t)(sizeof(fat_header) + arrArches.size() * sizeof(fat_arch)) : 0;
+	vector<uint32_t> arrNewOffsets;
+	for (size_t i = 0; i < arrArches.size(); i++)
+	{
+		if (i > 0 && arrOldOffsets[i] < arrOldOffsets[i - 1] + arrSizes[i - 1])
+		{
+			ZLog::Error(">>> Unsorted Arches In Fat Macho File!\n");
+			return false;
+		}
+
+		fat_arch &arch = arrArches[i];
+		uint32_t uAlignBits = (FAT_MAGIC == fath.magic) ? arch.align : BE(arch.align);
+		uint32_t uAlign = (uAlignBits < 31) ? (1u << uAlignBits) : 16384;
+		uOffset = bFat ? ((uOffset + uAlign - 1) / uAlign * uAlign) : 0;
+		if (uOffset > arrOldOffsets[i])
+		{
+			uOffset = arrOldOffsets[i];
+		}
+		arch.offset = (FAT_MAGIC == fath.magic) ? uOffset : BE(uOffset);
+		arrNewOffsets.push_back(uOffset);
+		uOffset += arrSizes[i];
+	}
+	size_t sNewSize = uOffset;
+	fath.nfat_arch = (FAT_MAGIC == fath.magic) ? (uint32_t)arrArches.size() : BE((uint32_t)arrArches.size());
 
-			AppendFile(strNewFatMachOFile.c_str(), (const char *)pData, sSize);
-			AppendFile(strNewFatMachOFile.c_str(), strPadding);
+	ZLog::WarnV(">>> Thin: \t%s, %u -> %u arches (%s)\n", basename((char *)m_strFile.c_str()), nFatArch, (uint32_t)arrArches.size(), strArches.c_str());
+	if (!CloseFile())
+	{ //pending load command edits go to disk before the slices move
+		return false;
+	}
 
-			munmap((void *)pData, sSize);
-			RemoveFile(strNewArchOFile.c_str());
+	struct stat st;
+	int fd = open(m_strFile.c_str(), O_RDWR);
+	if (fd < 0 || 0 != fstat(fd, &st) || (size_t)st.st_size != sOldSize)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
 		}
+		return false;
+	}
 
-		RemoveFile(m_strFile.c_str());
-		if (0 == rename(strNewFatMachOFile.c_str(), m_strFile.c_str()))
+	//front to back, a slice only moves over data already moved
+	bool bMoved = true;
+	for (size_t i = 0; i < arrArches.size() && bMoved; i++)
+	{
+		bMoved = MoveFileData(fd, arrNewOffsets[i], arrOldOffsets[i], arrSizes[i]);
+	}
+
+	if (bFat && bMoved)
+	{ //clear the padding between the slices, the tail is cut off below
+		size_t sLiveEnd = sizeof(fat_header) + arrArches.size() * sizeof(fat_arch);
+		for (size_t i = 0; i < arrArches.size() && bMoved; i++)
 		{
-			return OpenFile(m_strFile.c_str());
+			if (arrNewOffsets[i] > sLiveEnd)
+			{
+				bMoved = ZeroFileData(fd, sLiveEnd, arrNewOffsets[i] - sLiveEnd);
+			}
+			sLiveEnd = arrNewOffsets[i] + arrSizes[i];
 		}
+		bMoved = bMoved && WriteFileAt(fd, 0, &fath, sizeof(fat_header)) && WriteFileAt(fd, sizeof(fat_header), arrArches.data(), arrArches.size() * sizeof(fat_arch));
 	}
 
-	return false;
+	if (!bMoved || 0 != ftruncate(fd, (off_t)sNewSize))
+	{
+		ZLog::ErrorV(">>> Can't Thin File! %s, %s\n", m_strFile.c_str(), strerror(errno));
+		close(fd);
+		return false;
+	}
+	close(fd);
+	return ReopenFile(arrDirtyPages);
+}
+
+bool ZMachO::ReopenFile(const vector<set<uint32_t> > &arrDirtyPages)
+{
+	if (!OpenFile(m_strFile.c_str()) || arrDirtyPages.size() != m_arrArchOes.size())
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < m_arrArchOes.size(); i++)
+	{
+		m_arrArchOes[i]->m_setDirtyPages = arrDirtyPages[i];
+	}
+	return true;
 }
 
 bool ZMachO::InjectDyLib(bool bWeakInject, const char *szDyLibPath, bool &bCreate)
 {
 	ZLog::WarnV(">>> Inject DyLib: %s ... \n", szDyLibPath);
 
-	vector<uint32_t> arrMachOesSizes;
+	vector<ZLoadCommandEdit> arrEdits(1);
+	arrEdits[0].uType = E_LOAD_COMMAND_INJECT;
+	arrEdits[0].strPath = szDyLibPath;
+	arrEdits[0].bWeak = bWeakInject;
+
+	bool bChanged = false;
+	if (!EditLoadCommands(arrEdits, bChanged))
+	{
+		ZLog::Error(">>> Failed!\n");
+		return false;
+	}
+	if (bChanged)
+	{
+		bCreate = true;
+	}
+	ZLog::Warn(">>> Success!\n");
+	return true;
+}
+
+bool ZMachO::EditLoadCommands(const vector<ZLoadCommandEdit> &arrEdits, bool &bChanged)
+{
+	//plan every slice before writing any, so the file is left as it was if one of them runs out of space
+	vector<string> arrCommands(m_arrArchOes.size());
+	vector<uint32_t> arrCommandCounts(m_arrArchOes.size(), 0);
 	for (size_t i = 0; i < m_arrArchOes.size(); i++)
 	{
-		if (!m_arrArchOes[i]->InjectDyLib(bWeakInject, szDyLibPath, bCreate))
+		if (!m_arrArchOes[i]->PlanLoadCommands(arrEdits, arrCommands[i], arrCommandCounts[i]))
+		{
+			return false;
+		}
+	}
+
+	bChanged = false;
+	for (size_t i = 0; i < m_arrArchOes.size(); i++)
+	{
+		if (!m_arrArchOes[i]->ApplyLoadCommands(arrCommands[i], arrCommandCounts[i], bChanged))
 		{
-			ZLog::Error(">>> Failed!\n");
 			return false;
 		}
 	}
-	ZLog::Warn(">>> Success!\n");
 	return true;
 }
@@ -14,11 +14,15 @@ public:
 	void PrintInfo();
 	bool Sign(ZSignAsset *pSignAsset, bool bForce, string strBundleId, string strInfoPlistSHA1, string strInfoPlistSHA256, const string &strCodeResourcesData);
 	bool InjectDyLib(bool bWeakInject, const char *szDyLibPath, bool &bCreate);
+	bool EditLoadCommands(const vector<ZLoadCommandEdit> &arrEdits, bool &bChanged);
 
 private:
 	bool OpenFile(const char *szPath);
 	bool CloseFile();
-	bool ReallocCodeSignSpace();
+	bool FlushFile();
+	bool ReallocCodeSignSpace(const vector<uint32_t> &arrSignLengths);
+	bool ThinFile(const set<string> &setArches);
+	bool ReopenFile(const vector<set<uint32_t> > &arrDirtyPages);
 	bool NewArchO(uint8_t *pBase, uint32_t uLength);
 	void FreeArchOes();
 
@@ -27,5 +31,5 @@ private:
 	size_t m_sSize;
 	string m_strFile;
 	vector<ZArchO *> m_arrArchOes;
-	bool m_bCSRealloced;
+	ZMemoryGrant m_grant;
 };
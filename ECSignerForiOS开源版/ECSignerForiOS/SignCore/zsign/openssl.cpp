@@ -115,133 +115,504 @@ bool CMSError()
 
 bool isG3CerForX509(X509* usrCert)
 {
-    X509_NAME* name = X509_get_issuer_name(usrCert);
-    char* x509Data = X509_NAME_oneline(name, NULL, 0);
-    char* loc = strstr(x509Data, "OU=G3");
-    bool G3 = loc != NULL;
+    char* x509Data = X509_NAME_oneline(X509_get_issuer_name(usrCert), NULL, 0);
+    bool G3 = (NULL != x509Data && NULL != strstr(x509Data, "OU=G3"));
+    OPENSSL_free(x509Data);
     return G3;
 }
 
-bool GenerateCMS(X509 *scert, EVP_PKEY *spkey, const string &strCDHashData, const string &strCDHashesPlist, string &strCMSOutput)
+X509 *ReadPEMCert(const char *szPEM)
 {
-	if (!scert || !spkey)
+	BIO *bio = BIO_new_mem_buf(szPEM, (int)strlen(szPEM));
+	if (!bio)
 	{
-		return CMSError();
+		return NULL;
 	}
+	X509 *cert = PEM_read_bio_X509(bio, NULL, 0, NULL);
+	BIO_free(bio);
+	return cert;
+}
 
-	BIO *bother1;
-    BIO *bother2 = BIO_new_mem_buf(appleRootCACert, strlen(appleRootCACert));
-    if (isG3CerForX509(scert)) {
-        bother1 = BIO_new_mem_buf(appleDevCACert_G3, strlen(appleDevCACert_G3));
-    } else {
-        bother1 = BIO_new_mem_buf(appleDevCACert, strlen(appleDevCACert));
-    }
-	if (!bother1 || !bother2)
+static bool DERRead(const uint8_t *p, size_t sSize, size_t &sHeader, size_t &sLength)
+{ //single byte tags and definite lengths, which is all i2d emits
+	if (sSize < 2)
 	{
-		return CMSError();
+		return false;
 	}
 
-	X509 *ocert1 = PEM_read_bio_X509(bother1, NULL, 0, NULL);
-	X509 *ocert2 = PEM_read_bio_X509(bother2, NULL, 0, NULL);
-	if (!ocert1 || !ocert2)
+	sHeader = 2;
+	sLength = p[1];
+	if (sLength & 0x80)
 	{
-		return CMSError();
+		size_t sBytes = sLength & 0x7f;
+		if (0 == sBytes || sBytes > 4 || sSize < 2 + sBytes)
+		{
+			return false;
+		}
+		sLength = 0;
+		for (size_t i = 0; i < sBytes; i++)
+		{
+			sLength = (sLength << 8) | p[2 + i];
+		}
+		sHeader += sBytes;
 	}
+	return (sHeader + sLength <= sSize);
+}
 
-	STACK_OF(X509) *otherCerts = sk_X509_new_null();
-	if (!otherCerts)
+static bool DERChildren(const string &strData, vector<string> &arrChildren)
+{ //splits the content of a constructed element into its elements
+	arrChildren.clear();
+	const uint8_t *p = (const uint8_t *)strData.data();
+	size_t sOffset = 0;
+	while (sOffset < strData.size())
+	{
+		size_t sHeader = 0;
+		size_t sLength = 0;
+		if (!DERRead(p + sOffset, strData.size() - sOffset, sHeader, sLength))
+		{
+			return false;
+		}
+		arrChildren.push_back(strData.substr(sOffset, sHeader + sLength));
+		sOffset += sHeader + sLength;
+	}
+	return true;
+}
+
+static string DERContent(const string &strElement)
+{
+	size_t sHeader = 0;
+	size_t sLength = 0;
+	if (!DERRead((const uint8_t *)strElement.data(), strElement.size(), sHeader, sLength))
+	{
+		return "";
+	}
+	return strElement.substr(sHeader, sLength);
+}
+
+static string DEREncode(uint8_t uTag, const string &strContent)
+{
+	string strElement;
+	strElement.append(1, (char)uTag);
+	size_t sLength = strContent.size();
+	if (sLength < 0x80)
+	{
+		strElement.append(1, (char)sLength);
+	}
+	else
+	{
+		uint8_t uBytes = 0;
+		for (size_t n = sLength; n > 0; n >>= 8)
+		{
+			uBytes++;
+		}
+		strElement.append(1, (char)(0x80 | uBytes));
+		for (int i = uBytes - 1; i >= 0; i--)
+		{
+			strElement.append(1, (char)((sLength >> (8 * i)) & 0xff));
+		}
+	}
+	strElement.append(strContent);
+	return strElement;
+}
+
+static bool DERLess(const string &strA, const string &strB)
+{ //SET OF order, as openssl sorts the signed attributes
+	int nCmp = memcmp(strA.data(), strB.data(), min(strA.size(), strB.size()));
+	return (0 != nCmp) ? (nCmp < 0) : (strA.size() < strB.size());
+}
+
+static string OBJToDER(const ASN1_OBJECT *obj)
+{
+	string strDER;
+	int nLength = i2d_ASN1_OBJECT((ASN1_OBJECT *)obj, NULL);
+	if (nLength > 0)
+	{
+		strDER.resize(nLength);
+		uint8_t *p = (uint8_t *)&strDER[0];
+		i2d_ASN1_OBJECT((ASN1_OBJECT *)obj, &p);
+	}
+	return strDER;
+}
+
+static string DERTime(time_t tTime)
+{ //UTCTime until 2049, GeneralizedTime after, as ASN1_TIME_set does
+	struct tm tmTime;
+	gmtime_r(&tTime, &tmTime);
+	char szTime[32] = {0};
+	bool bUTC = (tmTime.tm_year >= 50 && tmTime.tm_year < 150);
+	strftime(szTime, sizeof(szTime), bUTC ? "%y%m%d%H%M%SZ" : "%Y%m%d%H%M%SZ", &tmTime);
+	return DEREncode(bUTC ? V_ASN1_UTCTIME : V_ASN1_GENERALIZEDTIME, szTime);
+}
+
+static string DERAttribute(const string &strOID, const string &strValue)
+{
+	return DEREncode(0x30, strOID + DEREncode(0x31, strValue));
+}
+
+ZCMSSigner::ZCMSSigner()
+{
+	m_x509Cert = NULL;
+	m_evpPkey = NULL;
+	m_otherCerts = NULL;
+	m_objCDHashes = NULL;
+	m_bTemplate = false;
+	m_evpDigest = NULL;
+}
+
+ZCMSSigner::~ZCMSSigner()
+{
+	Free();
+}
+
+bool ZCMSSigner::Init(void *x509Cert, void *evpPkey)
+{
+	Free();
+
+	X509 *scert = (X509 *)x509Cert;
+	EVP_PKEY *spkey = (EVP_PKEY *)evpPkey;
+	if (!scert || !spkey)
 	{
 		return CMSError();
 	}
 
-	if (!sk_X509_push(otherCerts, ocert1))
+	X509 *ocert1 = ReadPEMCert(isG3CerForX509(scert) ? appleDevCACert_G3 : appleDevCACert);
+	X509 *ocert2 = ReadPEMCert(appleRootCACert);
+	STACK_OF(X509) *otherCerts = sk_X509_new_null();
+	ASN1_OBJECT *obj = OBJ_txt2obj("1.2.840.113635.100.9.1", 1);
+	if (!ocert1 || !ocert2 || !otherCerts || !obj || !sk_X509_push(otherCerts, ocert1))
 	{
+		X509_free(ocert1);
+		X509_free(ocert2);
+		sk_X509_free(otherCerts);
+		ASN1_OBJECT_free(obj);
 		return CMSError();
 	}
 
 	if (!sk_X509_push(otherCerts, ocert2))
 	{
+		X509_free(ocert2);
+		sk_X509_pop_free(otherCerts, X509_free);
+		ASN1_OBJECT_free(obj);
 		return CMSError();
 	}
 
-	BIO *in = BIO_new_mem_buf(strCDHashData.c_str(), strCDHashData.size());
-	if (!in)
+	X509_up_ref(scert);
+	EVP_PKEY_up_ref(spkey);
+	m_x509Cert = scert;
+	m_evpPkey = spkey;
+	m_otherCerts = otherCerts;
+	m_objCDHashes = obj;
+
+	m_bTemplate = BuildTemplate();
+	if (!m_bTemplate)
 	{
-		return CMSError();
+		ZLog::Warn(">>> CMS Template Unavailable, Use OpenSSL!\n");
 	}
+	return true;
+}
 
-	int nFlags = CMS_DETACHED | CMS_NOSMIMECAP | CMS_BINARY | CMS_PARTIAL;
+void ZCMSSigner::Free()
+{
+	X509_free((X509 *)m_x509Cert);
+	EVP_PKEY_free((EVP_PKEY *)m_evpPkey);
+	sk_X509_pop_free((STACK_OF(X509) *)m_otherCerts, X509_free);
+	ASN1_OBJECT_free((ASN1_OBJECT *)m_objCDHashes);
+	m_x509Cert = NULL;
+	m_evpPkey = NULL;
+	m_otherCerts = NULL;
+	m_objCDHashes = NULL;
+	m_bTemplate = false;
+	m_evpDigest = NULL;
+	m_arrFixedAttrs.clear();
+
+	lock_guard<mutex> lock(m_mutex);
+	for (size_t i = 0; i < m_arrOutputs.size(); i++)
+	{
+		BIO_free((BIO *)m_arrOutputs[i]);
+	}
+	m_arrOutputs.clear();
+}
 
-	CMS_ContentInfo *cms = CMS_sign(NULL, NULL, otherCerts, in, nFlags);
-	if (!cms)
+bool ZCMSSigner::Sign(const string &strCDHashData, const string &strCDHashesPlist, string &strCMSOutput)
+{
+	if (!m_bTemplate)
 	{
-		return CMSError();
+		return SignOpenSSL(strCDHashData, strCDHashesPlist, 0, strCMSOutput);
 	}
 
-	CMS_SignerInfo *si = CMS_add1_signer(cms, scert, spkey, NULL, nFlags);
-	if (!si)
+	time_t tSigningTime = time(NULL);
+	if (!SignTemplate(strCDHashData, strCDHashesPlist, tSigningTime, strCMSOutput))
 	{
-		return CMSError();
+		return false;
 	}
 
-	ASN1_OBJECT *obj = OBJ_txt2obj("1.2.840.113635.100.9.1", 1);
-	if (!obj)
+#ifdef DEBUG
+	string strOpenSSLCMSData;
+	if (!SignOpenSSL(strCDHashData, strCDHashesPlist, tSigningTime, strOpenSSLCMSData))
 	{
-		return CMSError();
+		return false;
 	}
+	if (!CheckTemplate(strCMSOutput, strOpenSSLCMSData, strCDHashData))
+	{
+		ZLog::Error(">>> CMS Template Mismatch! Use OpenSSL Output.\n");
+		strCMSOutput = strOpenSSLCMSData;
+	}
+#endif
+	return true;
+}
 
-	if (!CMS_signed_add1_attr_by_OBJ(si, obj, 0x4, strCDHashesPlist.c_str(), strCDHashesPlist.size()))
+bool ZCMSSigner::SignOpenSSL(const string &strCDHashData, const string &strCDHashesPlist, time_t tSigningTime, string &strCMSOutput)
+{
+	if (!m_x509Cert || !m_evpPkey)
 	{
 		return CMSError();
 	}
 
-	if (!CMS_final(cms, in, NULL, nFlags))
+	BIO *in = BIO_new_mem_buf(strCDHashData.c_str(), (int)strCDHashData.size());
+	if (!in)
 	{
 		return CMSError();
 	}
 
-	BIO *out = BIO_new(BIO_s_mem());
+	BIO *out = NULL;
+	{
+		lock_guard<mutex> lock(m_mutex);
+		if (!m_arrOutputs.empty())
+		{
+			out = (BIO *)m_arrOutputs.back();
+			m_arrOutputs.pop_back();
+		}
+	}
 	if (!out)
 	{
-		return CMSError();
+		out = BIO_new(BIO_s_mem());
 	}
 
-	//PEM_write_bio_CMS(out, cms);
-	if (!i2d_CMS_bio(out, cms))
-	{
-		return CMSError();
+	int nFlags = CMS_DETACHED | CMS_NOSMIMECAP | CMS_BINARY | CMS_PARTIAL;
+	CMS_ContentInfo *cms = out ? CMS_sign(NULL, NULL, (STACK_OF(X509) *)m_otherCerts, in, nFlags) : NULL;
+	CMS_SignerInfo *si = cms ? CMS_add1_signer(cms, (X509 *)m_x509Cert, (EVP_PKEY *)m_evpPkey, NULL, nFlags) : NULL;
+	bool bRet = (NULL != si);
+	bRet = bRet && CMS_signed_add1_attr_by_OBJ(si, (ASN1_OBJECT *)m_objCDHashes, 0x4, strCDHashesPlist.c_str(), (int)strCDHashesPlist.size());
+	if (bRet && 0 != tSigningTime)
+	{ //a fixed time instead of the one CMS_final would add
+		ASN1_TIME *pTime = ASN1_TIME_set(NULL, tSigningTime);
+		bRet = (NULL != pTime) && CMS_signed_add1_attr_by_NID(si, NID_pkcs9_signingTime, pTime->type, pTime, -1);
+		ASN1_TIME_free(pTime);
 	}
+	bRet = bRet && CMS_final(cms, in, NULL, nFlags);
+	bRet = bRet && i2d_CMS_bio(out, cms);
 
 	BUF_MEM *bptr = NULL;
-	BIO_get_mem_ptr(out, &bptr);
-	if (!bptr)
+	if (bRet)
 	{
-		return CMSError();
+		BIO_get_mem_ptr(out, &bptr);
 	}
 
 	strCMSOutput.clear();
-	strCMSOutput.append(bptr->data, bptr->length);
-	return (!strCMSOutput.empty());
+	if (NULL != bptr)
+	{
+		strCMSOutput.append(bptr->data, bptr->length);
+	}
+
+	CMS_ContentInfo_free(cms);
+	BIO_free(in);
+	if (out)
+	{ //emptied for the next signature
+		BIO_reset(out);
+		lock_guard<mutex> lock(m_mutex);
+		m_arrOutputs.push_back(out);
+	}
+	return strCMSOutput.empty() ? CMSError() : true;
 }
 
-bool GenerateCMS(const string &strSignerCertData, const string &strSignerPKeyData, const string &strCDHashData, const string &strCDHashesPlist, string &strCMSOutput)
+bool ZCMSSigner::BuildTemplate()
 {
-	BIO *bcert = BIO_new_mem_buf(strSignerCertData.c_str(), strSignerCertData.size());
-	BIO *bpkey = BIO_new_mem_buf(strSignerPKeyData.c_str(), strSignerPKeyData.size());
+	//cut a signed dummy at the elements that change per signature
+	time_t tSigningTime = time(NULL);
+	string strDummyCMS;
+	if (!SignOpenSSL("ZSign", "ZSign", tSigningTime, strDummyCMS))
+	{
+		return false;
+	}
 
-	if (!bcert || !bpkey)
+	vector<string> arrContentInfo;
+	vector<string> arrExplicit;
+	vector<string> arrSignedData;
+	vector<string> arrSignerInfos;
+	vector<string> arrSignerInfo;
+	vector<string> arrAttrs;
+	if (!DERChildren(DERContent(strDummyCMS), arrContentInfo) || 2 != arrContentInfo.size() || 0xa0 != (uint8_t)arrContentInfo[1][0])
+	{
+		return false;
+	}
+	if (!DERChildren(DERContent(arrContentInfo[1]), arrExplicit) || 1 != arrExplicit.size() || !DERChildren(DERContent(arrExplicit[0]), arrSignedData) || arrSignedData.empty())
+	{
+		return false;
+	}
+	if (0x31 != (uint8_t)arrSignedData.back()[0] || !DERChildren(DERContent(arrSignedData.back()), arrSignerInfos) || 1 != arrSignerInfos.size())
+	{
+		return false;
+	}
+	if (!DERChildren(DERContent(arrSignerInfos[0]), arrSignerInfo) || arrSignerInfo.size() < 3)
+	{
+		return false;
+	}
+
+	//version, sid, digestAlgorithm, [0] signedAttrs, signatureAlgorithm, signature, and no unsigned attributes
+	size_t sAttrs = arrSignerInfo.size() - 3;
+	if (0xa0 != (uint8_t)arrSignerInfo[sAttrs][0] || 0x04 != (uint8_t)arrSignerInfo.back()[0] || !DERChildren(DERContent(arrSignerInfo[sAttrs]), arrAttrs))
+	{
+		return false;
+	}
+
+	m_strContentType = arrContentInfo[0];
+	m_strSignedDataHead.clear();
+	for (size_t i = 0; i + 1 < arrSignedData.size(); i++)
+	{
+		m_strSignedDataHead += arrSignedData[i];
+	}
+	m_strSignerInfoHead.clear();
+	for (size_t i = 0; i < sAttrs; i++)
+	{
+		m_strSignerInfoHead += arrSignerInfo[i];
+	}
+	m_strSignatureAlgorithm = arrSignerInfo[sAttrs + 1];
+
+	ASN1_OBJECT *objSigningTime = OBJ_nid2obj(NID_pkcs9_signingTime);
+	ASN1_OBJECT *objMessageDigest = OBJ_nid2obj(NID_pkcs9_messageDigest);
+	m_strOIDSigningTime = OBJToDER(objSigningTime);
+	m_strOIDMessageDigest = OBJToDER(objMessageDigest);
+	m_strOIDCDHashes = OBJToDER((ASN1_OBJECT *)m_objCDHashes);
+
+	uint32_t uVariableAttrs = 0;
+	m_arrFixedAttrs.clear();
+	for (size_t i = 0; i < arrAttrs.size(); i++)
+	{
+		string strAttr = DERContent(arrAttrs[i]);
+		if (0 == strAttr.compare(0, m_strOIDSigningTime.size(), m_strOIDSigningTime) || 0 == strAttr.compare(0, m_strOIDMessageDigest.size(), m_strOIDMessageDigest) || 0 == strAttr.compare(0, m_strOIDCDHashes.size(), m_strOIDCDHashes))
+		{
+			uVariableAttrs++;
+		}
+		else
+		{
+			m_arrFixedAttrs.push_back(arrAttrs[i]);
+		}
+	}
+	if (3 != uVariableAttrs)
+	{
+		return false;
+	}
+
+	//the digest of the signer, as CMS_add1_signer picked it
+	CMS_ContentInfo *cms = NULL;
+	const uint8_t *pDummyCMS = (const uint8_t *)strDummyCMS.data();
+	cms = d2i_CMS_ContentInfo(NULL, &pDummyCMS, (long)strDummyCMS.size());
+	STACK_OF(CMS_SignerInfo) *sis = cms ? CMS_get0_SignerInfos(cms) : NULL;
+	X509_ALGOR *algDigest = NULL;
+	if (NULL != sis && 1 == sk_CMS_SignerInfo_num(sis))
+	{
+		CMS_SignerInfo_get0_algs(sk_CMS_SignerInfo_value(sis, 0), NULL, NULL, &algDigest, NULL);
+	}
+	const ASN1_OBJECT *objDigest = NULL;
+	if (NULL != algDigest)
+	{
+		X509_ALGOR_get0(&objDigest, NULL, NULL, algDigest);
+	}
+	m_evpDigest = (NULL != objDigest) ? EVP_get_digestbyobj(objDigest) : NULL;
+	CMS_ContentInfo_free(cms);
+	if (NULL == m_evpDigest)
+	{
+		return false;
+	}
+
+	//the skeleton must reproduce what openssl made for the same input
+	string strTemplateCMS;
+	return SignTemplate("ZSign", "ZSign", tSigningTime, strTemplateCMS) && CheckTemplate(strTemplateCMS, strDummyCMS, "ZSign");
+}
+
+bool ZCMSSigner::SignTemplate(const string &strCDHashData, const string &strCDHashesPlist, time_t tSigningTime, string &strCMSOutput)
+{
+	strCMSOutput.clear();
+
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	unsigned int uDigestLength = 0;
+	if (!EVP_Digest(strCDHashData.data(), strCDHashData.size(), digest, &uDigestLength, (const EVP_MD *)m_evpDigest, NULL))
 	{
 		return CMSError();
 	}
 
-	X509 *scert = PEM_read_bio_X509(bcert, NULL, 0, NULL);
-	EVP_PKEY *spkey = PEM_read_bio_PrivateKey(bpkey, NULL, 0, NULL);
-	if (!scert || !spkey)
+	vector<string> arrAttrs = m_arrFixedAttrs;
+	arrAttrs.push_back(DERAttribute(m_strOIDSigningTime, DERTime(tSigningTime)));
+	arrAttrs.push_back(DERAttribute(m_strOIDMessageDigest, DEREncode(0x04, string((const char *)digest, uDigestLength))));
+	arrAttrs.push_back(DERAttribute(m_strOIDCDHashes, DEREncode(0x04, strCDHashesPlist)));
+	sort(arrAttrs.begin(), arrAttrs.end(), DERLess);
+
+	string strAttrs;
+	for (size_t i = 0; i < arrAttrs.size(); i++)
+	{
+		strAttrs += arrAttrs[i];
+	}
+
+	//the signature covers the attributes encoded as a SET, not as the [0] they are stored in
+	string strSignedAttrs = DEREncode(0x31, strAttrs);
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	size_t sSignature = 0;
+	bool bRet = (NULL != ctx);
+	bRet = bRet && (1 == EVP_DigestSignInit(ctx, NULL, (const EVP_MD *)m_evpDigest, NULL, (EVP_PKEY *)m_evpPkey));
+	bRet = bRet && (1 == EVP_DigestSignUpdate(ctx, strSignedAttrs.data(), strSignedAttrs.size()));
+	bRet = bRet && (1 == EVP_DigestSignFinal(ctx, NULL, &sSignature));
+	string strSignature(sSignature, 0);
+	bRet = bRet && (1 == EVP_DigestSignFinal(ctx, (uint8_t *)&strSignature[0], &sSignature));
+	EVP_MD_CTX_free(ctx);
+	if (!bRet)
 	{
 		return CMSError();
 	}
+	strSignature.resize(sSignature);
+
+	string strSignerInfo = DEREncode(0x30, m_strSignerInfoHead + DEREncode(0xa0, strAttrs) + m_strSignatureAlgorithm + DEREncode(0x04, strSignature));
+	string strSignedData = DEREncode(0x30, m_strSignedDataHead + DEREncode(0x31, strSignerInfo));
+	strCMSOutput = DEREncode(0x30, m_strContentType + DEREncode(0xa0, strSignedData));
+	return true;
+}
+
+bool ZCMSSigner::CheckTemplate(const string &strCMSData, const string &strOpenSSLCMSData, const string &strCDHashData)
+{
+	if (strCMSData == strOpenSSLCMSData)
+	{
+		return true;
+	}
+
+	if (EVP_PKEY_RSA == EVP_PKEY_base_id((EVP_PKEY *)m_evpPkey))
+	{ //pkcs1 signatures are deterministic, any difference is a bug
+		return false;
+	}
+
+	//ecdsa signs with a random nonce, so only check that openssl accepts it and the sizes agree
+	const uint8_t *p = (const uint8_t *)strCMSData.data();
+	CMS_ContentInfo *cms = d2i_CMS_ContentInfo(NULL, &p, (long)strCMSData.size());
+	BIO *in = BIO_new_mem_buf(strCDHashData.data(), (int)strCDHashData.size());
+	bool bRet = (NULL != cms && NULL != in && 1 == CMS_verify(cms, NULL, NULL, in, NULL, CMS_BINARY | CMS_NO_SIGNER_CERT_VERIFY));
+	CMS_ContentInfo_free(cms);
+	BIO_free(in);
+	ERR_clear_error();
+	return bRet && (strCMSData.size() + 8 >= strOpenSSLCMSData.size()) && (strCMSData.size() <= strOpenSSLCMSData.size() + 8);
+}
 
-	return GenerateCMS(scert, spkey, strCDHashData, strCDHashesPlist, strCMSOutput);
+bool GenerateCMS(const string &strSignerCertData, const string &strSignerPKeyData, const string &strCDHashData, const string &strCDHashesPlist, string &strCMSOutput)
+{
+	BIO *bcert = BIO_new_mem_buf(strSignerCertData.c_str(), strSignerCertData.size());
+	BIO *bpkey = BIO_new_mem_buf(strSignerPKeyData.c_str(), strSignerPKeyData.size());
+	X509 *scert = bcert ? PEM_read_bio_X509(bcert, NULL, 0, NULL) : NULL;
+	EVP_PKEY *spkey = bpkey ? PEM_read_bio_PrivateKey(bpkey, NULL, 0, NULL) : NULL;
+	BIO_free(bcert);
+	BIO_free(bpkey);
+
+	ZCMSSigner signer;
+	bool bRet = signer.Init(scert, spkey) && signer.Sign(strCDHashData, strCDHashesPlist, strCMSOutput);
+	X509_free(scert);
+	EVP_PKEY_free(spkey);
+	return bRet;
 }
 
 bool GetCMSContent(const string &strCMSDataInput, string &strContentOutput)
@@ -254,28 +625,26 @@ bool GetCMSContent(const string &strCMSDataInput, string &strContentOutput)
 	BIO *in = BIO_new(BIO_s_mem());
 	OPENSSL_assert((size_t)BIO_write(in, strCMSDataInput.data(), strCMSDataInput.size()) == strCMSDataInput.size());
 	CMS_ContentInfo *cms = d2i_CMS_bio(in, NULL);
+	BIO_free(in);
 	if (!cms)
 	{
 		return CMSError();
 	}
 
 	ASN1_OCTET_STRING **pos = CMS_get0_content(cms);
-	if (!pos)
-	{
-		return CMSError();
-	}
-
-	if (!(*pos))
+	if (!pos || !(*pos))
 	{
+		CMS_ContentInfo_free(cms);
 		return CMSError();
 	}
 
 	strContentOutput.clear();
 	strContentOutput.append((const char *)(*pos)->data, (*pos)->length);
+	CMS_ContentInfo_free(cms);
 	return (!strContentOutput.empty());
 }
 
-bool GetCertSubjectCN(X509 *cert, string &strSubjectCN)
+bool GetCertSubjectField(X509 *cert, int nNID, string &strValue)
 {
 	if (!cert)
 	{
@@ -284,27 +653,32 @@ bool GetCertSubjectCN(X509 *cert, string &strSubjectCN)
 
 	X509_NAME *name = X509_get_subject_name(cert);
 
-	int common_name_loc = X509_NAME_get_index_by_NID(name, NID_commonName, -1);
-	if (common_name_loc < 0)
+	int field_loc = X509_NAME_get_index_by_NID(name, nNID, -1);
+	if (field_loc < 0)
 	{
-		return CMSError();
+		return false;
 	}
 
-	X509_NAME_ENTRY *common_name_entry = X509_NAME_get_entry(name, common_name_loc);
-	if (common_name_entry == NULL)
+	X509_NAME_ENTRY *field_entry = X509_NAME_get_entry(name, field_loc);
+	if (field_entry == NULL)
 	{
 		return CMSError();
 	}
 
-	ASN1_STRING *common_name_asn1 = X509_NAME_ENTRY_get_data(common_name_entry);
-	if (common_name_asn1 == NULL)
+	ASN1_STRING *field_asn1 = X509_NAME_ENTRY_get_data(field_entry);
+	if (field_asn1 == NULL)
 	{
 		return CMSError();
 	}
 
-	strSubjectCN.clear();
-	strSubjectCN.append((const char *)common_name_asn1->data, common_name_asn1->length);
-	return (!strSubjectCN.empty());
+	strValue.clear();
+	strValue.append((const char *)field_asn1->data, field_asn1->length);
+	return (!strValue.empty());
+}
+
+bool GetCertSubjectCN(X509 *cert, string &strSubjectCN)
+{
+	return GetCertSubjectField(cert, NID_commonName, strSubjectCN) ? true : CMSError();
 }
 
 bool GetCertSubjectCN(const string &strCertData, string &strSubjectCN)
@@ -617,12 +991,449 @@ bool GetCMSInfo(uint8_t *pCMSData, uint32_t uCMSLength, JValue &jvOutput)
 
 ZSignAsset::ZSignAsset()
 {
+	m_uThreads = 0;
+	m_bIncremental = false;
+	m_uCMSSignatureSlotLimit = 0;
 	m_evpPkey = NULL;
 	m_x509Cert = NULL;
 }
 
+ZSignAsset::~ZSignAsset()
+{
+	Free();
+}
+
+void ZSignAsset::Free()
+{
+	m_cmsSigner.Free();
+	X509_free((X509 *)m_x509Cert);
+	EVP_PKEY_free((EVP_PKEY *)m_evpPkey);
+	m_x509Cert = NULL;
+	m_evpPkey = NULL;
+}
+
+bool LoadPrivateKey(const string &strPKeyData, const string &strPassword, EVP_PKEY *&evpPkey, X509 *&x509Cert)
+{ //PEM, DER or p12, a p12 also brings its certificate
+	evpPkey = NULL;
+	x509Cert = NULL;
+	BIO *bioPKey = BIO_new_mem_buf(strPKeyData.data(), (int)strPKeyData.size());
+	if (NULL != bioPKey)
+	{
+		evpPkey = PEM_read_bio_PrivateKey(bioPKey, NULL, NULL, (void *)strPassword.c_str());
+		if (NULL == evpPkey)
+		{
+			BIO_reset(bioPKey);
+			evpPkey = d2i_PrivateKey_bio(bioPKey, NULL);
+			if (NULL == evpPkey)
+			{
+				BIO_reset(bioPKey);
+				PKCS12 *p12 = d2i_PKCS12_bio(bioPKey, NULL);
+				if (NULL != p12)
+				{
+					if (0 == PKCS12_parse(p12, strPassword.c_str(), &evpPkey, &x509Cert, NULL))
+					{
+						CMSError();
+					}
+					PKCS12_free(p12);
+				}
+			}
+		}
+		BIO_free(bioPKey);
+	}
+	ERR_clear_error();
+	return (NULL != evpPkey);
+}
+
+ZIdentityStore::ZIdentityStore()
+{
+	m_uLimit = IDENTITY_STORE_LIMIT;
+}
+
+ZIdentityStore::~ZIdentityStore()
+{
+	Clear();
+}
+
+ZIdentityStore &ZIdentityStore::Shared()
+{
+	static ZIdentityStore s_store;
+	return s_store;
+}
+
+string ZIdentityStore::GetKey(const string &strPKeyData, const string &strPassword)
+{
+	string strKeySHA256;
+	string strPasswordSHA256;
+	SHASum(E_SHASUM_TYPE_256, strPKeyData, strKeySHA256);
+	SHASum(E_SHASUM_TYPE_256, strPassword, strPasswordSHA256);
+	return strKeySHA256 + strPasswordSHA256;
+}
+
+void ZIdentityStore::SetLimit(uint32_t uLimit)
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_uLimit = (uLimit > 0) ? uLimit : 1;
+	Evict();
+}
+
+bool ZIdentityStore::Find(const string &strKey, void *&evpPkey, void *&x509Cert)
+{
+	lock_guard<mutex> lock(m_mutex);
+	map<string, ZIdentity>::iterator it = m_mapIdentities.find(strKey);
+	if (it == m_mapIdentities.end())
+	{
+		return false;
+	}
+
+	//most recently used at the front
+	m_lstOrder.splice(m_lstOrder.begin(), m_lstOrder, it->second.itOrder);
+	EVP_PKEY_up_ref((EVP_PKEY *)it->second.evpPkey);
+	evpPkey = it->second.evpPkey;
+	x509Cert = NULL;
+	if (NULL != it->second.x509Cert)
+	{
+		X509_up_ref((X509 *)it->second.x509Cert);
+		x509Cert = it->second.x509Cert;
+	}
+	return true;
+}
+
+bool ZIdentityStore::Load(const string &strPKeyData, const string &strPassword, string &strKey, void *&evpPkey, void *&x509Cert)
+{ //the p12 decryption is slow on purpose, decode each identity once per process
+	strKey = GetKey(strPKeyData, strPassword);
+	if (Find(strKey, evpPkey, x509Cert))
+	{
+		return true;
+	}
+
+	EVP_PKEY *evpPkeyLoaded = NULL;
+	X509 *x509CertLoaded = NULL;
+	if (!LoadPrivateKey(strPKeyData, strPassword, evpPkeyLoaded, x509CertLoaded))
+	{
+		return false;
+	}
+	Add(strKey, evpPkeyLoaded, x509CertLoaded);
+	evpPkey = evpPkeyLoaded;
+	x509Cert = x509CertLoaded;
+	return true;
+}
+
+void ZIdentityStore::Add(const string &strKey, void *evpPkey, void *x509Cert)
+{
+	lock_guard<mutex> lock(m_mutex);
+	if (NULL == evpPkey || m_mapIdentities.find(strKey) != m_mapIdentities.end())
+	{
+		return;
+	}
+
+	ZIdentity &identity = m_mapIdentities[strKey];
+	EVP_PKEY_up_ref((EVP_PKEY *)evpPkey);
+	identity.evpPkey = evpPkey;
+	identity.x509Cert = NULL;
+	if (NULL != x509Cert)
+	{
+		X509_up_ref((X509 *)x509Cert);
+		identity.x509Cert = x509Cert;
+	}
+	m_lstOrder.push_front(strKey);
+	identity.itOrder = m_lstOrder.begin();
+	Evict();
+}
+
+bool ZIdentityStore::Pair(const string &strKey, void *x509Cert, void *evpPkey, string &strSubjectCN, string &strTeamId)
+{
+	X509 *cert = (X509 *)x509Cert;
+	if (NULL == cert || NULL == evpPkey)
+	{
+		return false;
+	}
+
+	string strCertSHA256;
+	uint8_t *pCertData = NULL;
+	int nCertLength = i2d_X509(cert, &pCertData);
+	if (nCertLength > 0)
+	{
+		SHASum(E_SHASUM_TYPE_256, pCertData, nCertLength, strCertSHA256);
+	}
+	OPENSSL_free(pCertData);
+
+	{
+		lock_guard<mutex> lock(m_mutex);
+		map<string, ZIdentity>::iterator it = m_mapIdentities.find(strKey);
+		if (it != m_mapIdentities.end())
+		{
+			map<string, pair<string, string> >::iterator itCert = it->second.mapPairedCerts.find(strCertSHA256);
+			if (itCert != it->second.mapPairedCerts.end())
+			{
+				strSubjectCN = itCert->second.first;
+				strTeamId = itCert->second.second;
+				return true;
+			}
+		}
+	}
+
+	if (!X509_check_private_key(cert, (EVP_PKEY *)evpPkey))
+	{
+		ERR_clear_error();
+		return false;
+	}
+
+	strSubjectCN.clear();
+	strTeamId.clear();
+	GetCertSubjectCN(cert, strSubjectCN);
+	GetCertSubjectField(cert, NID_organizationalUnitName, strTeamId);
+	if (!strCertSHA256.empty())
+	{
+		lock_guard<mutex> lock(m_mutex);
+		map<string, ZIdentity>::iterator it = m_mapIdentities.find(strKey);
+		if (it != m_mapIdentities.end())
+		{
+			it->second.mapPairedCerts[strCertSHA256] = make_pair(strSubjectCN, strTeamId);
+		}
+	}
+	return true;
+}
+
+void ZIdentityStore::Clear()
+{
+	lock_guard<mutex> lock(m_mutex);
+	for (map<string, ZIdentity>::iterator it = m_mapIdentities.begin(); it != m_mapIdentities.end(); it++)
+	{
+		EVP_PKEY_free((EVP_PKEY *)it->second.evpPkey);
+		X509_free((X509 *)it->second.x509Cert);
+	}
+	m_mapIdentities.clear();
+	m_lstOrder.clear();
+}
+
+void ZIdentityStore::Evict()
+{
+	while (m_mapIdentities.size() > m_uLimit && !m_lstOrder.empty())
+	{ //assets that use an evicted identity hold their own references
+		map<string, ZIdentity>::iterator it = m_mapIdentities.find(m_lstOrder.back());
+		if (it != m_mapIdentities.end())
+		{
+			EVP_PKEY_free((EVP_PKEY *)it->second.evpPkey);
+			X509_free((X509 *)it->second.x509Cert);
+			m_mapIdentities.erase(it);
+		}
+		m_lstOrder.pop_back();
+	}
+}
+
+#define CERT_INDEX_MAGIC 0x5844495a //ZIDX
+#define CERT_INDEX_VERSION 1
+
+#pragma pack(push, 1)
+struct ZCertIndexHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint8_t provision[32]; //sha256 of the profile the index was built from
+};
+
+struct ZCertIndexRecord
+{
+	uint8_t spki[32];
+	uint32_t index;
+};
+#pragma pack(pop)
+
+static bool GetCertSPKISHA256(const string &strCertData, string &strSPKISHA256)
+{ //Certificate { tbsCertificate { [0] version, serial, signature, issuer, validity, subject, spki, ... } ... }
+	vector<string> arrCert;
+	vector<string> arrTBS;
+	if (!DERChildren(DERContent(strCertData), arrCert) || arrCert.empty() || !DERChildren(DERContent(arrCert[0]), arrTBS))
+	{
+		return false;
+	}
+
+	size_t sSPKI = (!arrTBS.empty() && 0xa0 == (uint8_t)arrTBS[0][0]) ? 6 : 5;
+	if (arrTBS.size() <= sSPKI || 0x30 != (uint8_t)arrTBS[sSPKI][0])
+	{
+		return false;
+	}
+	return SHASum(E_SHASUM_TYPE_256, arrTBS[sSPKI], strSPKISHA256);
+}
+
+bool ZCertIndex::GetSPKISHA256(void *evpPkey, string &strSPKISHA256)
+{
+	strSPKISHA256.clear();
+	uint8_t *pSPKIData = NULL;
+	int nSPKILength = i2d_PUBKEY((EVP_PKEY *)evpPkey, &pSPKIData);
+	if (nSPKILength > 0)
+	{
+		SHASum(E_SHASUM_TYPE_256, pSPKIData, nSPKILength, strSPKISHA256);
+	}
+	OPENSSL_free(pSPKIData);
+	return !strSPKISHA256.empty();
+}
+
+bool ZCertIndex::Load(const string &strProvisionFile, const string &strProvisionData, JValue *pjvProv)
+{
+	m_mapCerts.clear();
+	SHASum(E_SHASUM_TYPE_256, strProvisionData, m_strProvisionSHA256);
+
+	string strIndexFile;
+	if (!strProvisionFile.empty())
+	{
+		strIndexFile = strProvisionFile + ".certindex";
+		if (Read(strIndexFile))
+		{
+			return true;
+		}
+	}
+
+	JValue jvProv;
+	if (NULL == pjvProv)
+	{
+		string strProvContent;
+		if (!GetCMSContent(strProvisionData, strProvContent) || !jvProv.readPList(strProvContent))
+		{
+			return false;
+		}
+		pjvProv = &jvProv;
+	}
+
+	if (!Build(*pjvProv))
+	{
+		return false;
+	}
+
+	if (!strIndexFile.empty() && !Write(strIndexFile))
+	{ //read only profiles just rebuild the index next time
+		ZLog::DebugV(">>> Can't Save Certificate Index! %s\n", strIndexFile.c_str());
+	}
+	return true;
+}
+
+bool ZCertIndex::Find(const string &strSPKISHA256, uint32_t &uCertIndex)
+{
+	map<string, uint32_t>::iterator it = m_mapCerts.find(strSPKISHA256);
+	if (it == m_mapCerts.end())
+	{
+		return false;
+	}
+	uCertIndex = it->second;
+	return true;
+}
+
+bool ZCertIndex::Build(JValue &jvProv)
+{
+	JValue &jvCerts = jvProv["DeveloperCertificates"];
+	for (size_t i = 0; i < jvCerts.size(); i++)
+	{
+		string strSPKISHA256;
+		if (GetCertSPKISHA256(jvCerts[i].asData(), strSPKISHA256))
+		{ //the first one wins, as the linear search did
+			m_mapCerts.insert(make_pair(strSPKISHA256, (uint32_t)i));
+		}
+	}
+	return true;
+}
+
+bool ZCertIndex::Read(const string &strIndexFile)
+{
+	string strData;
+	if (!ReadFile(strIndexFile.c_str(), strData))
+	{
+		return false;
+	}
+
+	ZCertIndexHeader *pHeader = (ZCertIndexHeader *)strData.data();
+	if (strData.size() < sizeof(ZCertIndexHeader) || CERT_INDEX_MAGIC != pHeader->magic || CERT_INDEX_VERSION != pHeader->version || strData.size() != sizeof(ZCertIndexHeader) + (size_t)pHeader->count * sizeof(ZCertIndexRecord))
+	{
+		return false;
+	}
+
+	if (m_strProvisionSHA256.size() != sizeof(pHeader->provision) || 0 != memcmp(pHeader->provision, m_strProvisionSHA256.data(), sizeof(pHeader->provision)))
+	{ //the profile was replaced
+		return false;
+	}
+
+	const ZCertIndexRecord *pRecords = (const ZCertIndexRecord *)(strData.data() + sizeof(ZCertIndexHeader));
+	for (uint32_t i = 0; i < pHeader->count; i++)
+	{
+		m_mapCerts.insert(make_pair(string((const char *)pRecords[i].spki, sizeof(pRecords[i].spki)), pRecords[i].index));
+	}
+	return true;
+}
+
+bool ZCertIndex::Write(const string &strIndexFile)
+{
+	if (m_strProvisionSHA256.size() != 32)
+	{
+		return false;
+	}
+
+	ZCertIndexHeader header;
+	header.magic = CERT_INDEX_MAGIC;
+	header.version = CERT_INDEX_VERSION;
+	header.count = (uint32_t)m_mapCerts.size();
+	memcpy(header.provision, m_strProvisionSHA256.data(), sizeof(header.provision));
+
+	string strData;
+	strData.append((const char *)&header, sizeof(header));
+	for (map<string, uint32_t>::iterator it = m_mapCerts.begin(); it != m_mapCerts.end(); it++)
+	{
+		ZCertIndexRecord record;
+		memcpy(record.spki, it->first.data(), sizeof(record.spki));
+		record.index = it->second;
+		strData.append((const char *)&record, sizeof(record));
+	}
+
+	//several signers may index the same profile, replace it atomically
+	string strTempFile;
+	StringFormat(strTempFile, "%s.%d.tmp", strIndexFile.c_str(), (int)getpid());
+	if (!WriteFile(strTempFile.c_str(), strData) || 0 != rename(strTempFile.c_str(), strIndexFile.c_str()))
+	{
+		RemoveFile(strTempFile.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool ZCertIndex::FindProfiles(const string &strPKeyFile, const string &strPassword, const vector<string> &arrProvisionFiles, vector<string> &arrAcceptedFiles)
+{
+	arrAcceptedFiles.clear();
+	string strPKeyData;
+	ReadFile(strPKeyFile.c_str(), strPKeyData);
+
+	string strIdentityKey;
+	void *pKey = NULL;
+	void *pCert = NULL;
+	if (!ZIdentityStore::Shared().Load(strPKeyData, strPassword, strIdentityKey, pKey, pCert))
+	{
+		ZLog::Error(">>> Can't Load P12 or PrivateKey File! Please Input The Correct File And Password!\n");
+		return false;
+	}
+
+	string strSPKISHA256;
+	bool bSPKI = GetSPKISHA256(pKey, strSPKISHA256);
+	EVP_PKEY_free((EVP_PKEY *)pKey);
+	X509_free((X509 *)pCert);
+	if (!bSPKI)
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < arrProvisionFiles.size(); i++)
+	{
+		string strProvisionData;
+		ZCertIndex certIndex;
+		uint32_t uCertIndex = 0;
+		if (ReadFile(arrProvisionFiles[i].c_str(), strProvisionData) && certIndex.Load(arrProvisionFiles[i], strProvisionData) && certIndex.Find(strSPKISHA256, uCertIndex))
+		{
+			arrAcceptedFiles.push_back(arrProvisionFiles[i]);
+		}
+	}
+	return true;
+}
+
 bool ZSignAsset::Init(const string &strSignerCertFile, const string &strSignerPKeyFile, const string &strProvisionFile, const string &strEntitlementsFile, const string &strPassword)
 {
+	Free();
 	ReadFile(strProvisionFile.c_str(), m_strProvisionData);
 	ReadFile(strEntitlementsFile.c_str(), m_strEntitlementsData);
 	if (m_strProvisionData.empty())
@@ -651,34 +1462,15 @@ bool ZSignAsset::Init(const string &strSignerCertFile, const string &strSignerPK
 		return false;
 	}
 
-	X509 *x509Cert = NULL;
-	EVP_PKEY *evpPkey = NULL;
-	BIO *bioPKey = BIO_new_file(strSignerPKeyFile.c_str(), "r");
-	if (NULL != bioPKey)
-	{
-		evpPkey = PEM_read_bio_PrivateKey(bioPKey, NULL, NULL, (void *)strPassword.c_str());
-		if (NULL == evpPkey)
-		{
-			BIO_reset(bioPKey);
-			evpPkey = d2i_PrivateKey_bio(bioPKey, NULL);
-			if (NULL == evpPkey)
-			{
-				BIO_reset(bioPKey);
-				PKCS12 *p12 = d2i_PKCS12_bio(bioPKey, NULL);
-				if (NULL != p12)
-				{
-					if (0 == PKCS12_parse(p12, strPassword.c_str(), &evpPkey, &x509Cert, NULL))
-					{
-						CMSError();
-					}
-					PKCS12_free(p12);
-				}
-			}
-		}
-        
-		BIO_free(bioPKey);
-	}
+	string strPKeyData;
+	ReadFile(strSignerPKeyFile.c_str(), strPKeyData);
+	string strIdentityKey;
+	void *pKey = NULL;
+	void *pCert = NULL;
+	ZIdentityStore::Shared().Load(strPKeyData, strPassword, strIdentityKey, pKey, pCert);
 
+	EVP_PKEY *evpPkey = (EVP_PKEY *)pKey;
+	X509 *x509Cert = (X509 *)pCert;
 	if (NULL == evpPkey)
 	{
         ZLog::Error(">>> Can't Load P12 or PrivateKey File! Please Input The Correct File And Password!\n");
@@ -700,9 +1492,10 @@ bool ZSignAsset::Init(const string &strSignerCertFile, const string &strSignerPK
 		}
 	}
 
+	string strCertTeamId;
 	if (NULL != x509Cert)
 	{
-		if (!X509_check_private_key(x509Cert, evpPkey))
+		if (!ZIdentityStore::Shared().Pair(strIdentityKey, x509Cert, evpPkey, m_strSubjectCN, strCertTeamId))
 		{
 			X509_free(x509Cert);
 			x509Cert = NULL;
@@ -710,20 +1503,34 @@ bool ZSignAsset::Init(const string &strSignerCertFile, const string &strSignerPK
 	}
 
 	if (NULL == x509Cert)
-	{
-		for (size_t i = 0; i < jvProv["DeveloperCertificates"].size(); i++)
+	{ //one lookup in the certificate index of the profile instead of decoding and trying every certificate
+		ZCertIndex certIndex;
+		string strSPKISHA256;
+		uint32_t uCertIndex = 0;
+		if (certIndex.Load(strProvisionFile, m_strProvisionData, &jvProv) && ZCertIndex::GetSPKISHA256(evpPkey, strSPKISHA256) && certIndex.Find(strSPKISHA256, uCertIndex))
+		{
+			string strCertData = jvProv["DeveloperCertificates"][(int)uCertIndex].asData();
+			const uint8_t *pCertData = (const uint8_t *)strCertData.data();
+			x509Cert = d2i_X509(NULL, &pCertData, (long)strCertData.size());
+			if (NULL != x509Cert && !ZIdentityStore::Shared().Pair(strIdentityKey, x509Cert, evpPkey, m_strSubjectCN, strCertTeamId))
+			{
+				X509_free(x509Cert);
+				x509Cert = NULL;
+			}
+		}
+	}
+
+	if (NULL == x509Cert)
+	{ //keys whose public key is encoded differently from the certificate
+		for (size_t i = 0; i < jvProv["DeveloperCertificates"].size() && NULL == x509Cert; i++)
 		{
 			string strCertData = jvProv["DeveloperCertificates"][i].asData();
 			BIO *bioCert = BIO_new_mem_buf(strCertData.c_str(), strCertData.size());
 			if (NULL != bioCert)
 			{
 				x509Cert = d2i_X509_bio(bioCert, NULL);
-				if (NULL != x509Cert)
+				if (NULL != x509Cert && !ZIdentityStore::Shared().Pair(strIdentityKey, x509Cert, evpPkey, m_strSubjectCN, strCertTeamId))
 				{
-					if (X509_check_private_key(x509Cert, evpPkey))
-					{
-						break;
-					}
 					X509_free(x509Cert);
 					x509Cert = NULL;
 				}
@@ -735,21 +1542,32 @@ bool ZSignAsset::Init(const string &strSignerCertFile, const string &strSignerPK
 	if (NULL == x509Cert)
 	{
 		ZLog::Error(">>> Can't Find Paired Certificate And PrivateKey!\n");
+		EVP_PKEY_free(evpPkey);
 		return false;
 	}
 
-	if (!GetCertSubjectCN(x509Cert, m_strSubjectCN))
+	m_evpPkey = evpPkey;
+	m_x509Cert = x509Cert;
+	if (m_strSubjectCN.empty())
 	{
 		ZLog::Error(">>> Can't Find Paired Certificate Subject Common Name!\n");
 		return false;
 	}
 
-	m_evpPkey = evpPkey;
-	m_x509Cert = x509Cert;
+	if (!strCertTeamId.empty() && strCertTeamId != m_strTeamId)
+	{
+		ZLog::WarnV(">>> TeamId Of Certificate And Provision Differ! %s, %s\n", strCertTeamId.c_str(), m_strTeamId.c_str());
+	}
+
+	if (!m_cmsSigner.Init(x509Cert, evpPkey))
+	{
+		ZLog::Error(">>> Can't Load Apple Certificate Chain!\n");
+		return false;
+	}
 	return true;
 }
 
 bool ZSignAsset::GenerateCMS(const string &strCDHashData, const string &strCDHashesPlist, string &strCMSOutput)
 {
-	return ::GenerateCMS((X509 *)m_x509Cert, (EVP_PKEY *)m_evpPkey, strCDHashData, strCDHashesPlist, strCMSOutput);
+	return m_cmsSigner.Sign(strCDHashData, strCDHashesPlist, strCMSOutput);
 }
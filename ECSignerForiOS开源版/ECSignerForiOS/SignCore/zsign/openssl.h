@@ -6,10 +6,117 @@ bool GetCMSContent(const string &strCMSDataInput, string &strContentOutput);
 bool GetCertSubjectCN(const string &strCertData, string &strSubjectCN);
 bool GetCMSInfo(uint8_t *pCMSData, uint32_t uCMSLength, JValue &jvOutput);
 
+//the apple chain and the cdhashes oid are parsed once, each signature only builds its own cms.
+//Init also cuts a signed dummy into a der skeleton, later signatures only encode the signed attributes,
+//sign them once and splice them in. the skeleton is only used after it reproduced the openssl output.
+//Sign may run on several threads, the output buffers are pooled.
+class ZCMSSigner
+{
+public:
+	ZCMSSigner();
+	~ZCMSSigner();
+
+public:
+	bool Init(void *x509Cert, void *evpPkey);
+	bool Sign(const string &strCDHashData, const string &strCDHashesPlist, string &strCMSOutput);
+	void Free();
+
+private:
+	ZCMSSigner(const ZCMSSigner &);
+	ZCMSSigner &operator=(const ZCMSSigner &);
+	bool SignOpenSSL(const string &strCDHashData, const string &strCDHashesPlist, time_t tSigningTime, string &strCMSOutput);
+	bool SignTemplate(const string &strCDHashData, const string &strCDHashesPlist, time_t tSigningTime, string &strCMSOutput);
+	bool BuildTemplate();
+	bool CheckTemplate(const string &strCMSData, const string &strOpenSSLCMSData, const string &strCDHashData);
+
+private:
+	void *m_x509Cert;
+	void *m_evpPkey;
+	void *m_otherCerts;
+	void *m_objCDHashes;
+	mutex m_mutex;
+	vector<void *> m_arrOutputs;
+
+	bool m_bTemplate;
+	const void *m_evpDigest;
+	string m_strContentType;		//signedData oid of the ContentInfo
+	string m_strSignedDataHead;		//version, digestAlgorithms, encapContentInfo and certificates
+	string m_strSignerInfoHead;		//version, sid and digestAlgorithm
+	string m_strSignatureAlgorithm;
+	string m_strOIDSigningTime;
+	string m_strOIDMessageDigest;
+	string m_strOIDCDHashes;
+	vector<string> m_arrFixedAttrs;	//contentType and anything else openssl adds
+};
+
+#define IDENTITY_STORE_LIMIT 256
+
+//decoded signing identities of this process, so a p12 is only decrypted once however many jobs use it.
+//keyed by the sha256 of the key file and of the password, the least recently used are dropped over the limit.
+//the certificates that pair with a key are remembered with their subject CN and team id.
+class ZIdentityStore
+{
+public:
+	ZIdentityStore();
+	~ZIdentityStore();
+
+public:
+	static ZIdentityStore &Shared();
+	static string GetKey(const string &strPKeyData, const string &strPassword);
+
+public:
+	void SetLimit(uint32_t uLimit);
+	bool Find(const string &strKey, void *&evpPkey, void *&x509Cert);
+	bool Load(const string &strPKeyData, const string &strPassword, string &strKey, void *&evpPkey, void *&x509Cert);
+	void Add(const string &strKey, void *evpPkey, void *x509Cert);
+	bool Pair(const string &strKey, void *x509Cert, void *evpPkey, string &strSubjectCN, string &strTeamId);
+	void Clear();
+
+private:
+	void Evict();
+
+private:
+	struct ZIdentity
+	{
+		void *evpPkey;
+		void *x509Cert; //from the p12, NULL for plain keys
+		map<string, pair<string, string> > mapPairedCerts; //cert sha256 => subject CN, team id
+		list<string>::iterator itOrder;
+	};
+
+	mutex m_mutex;
+	uint32_t m_uLimit;
+	list<string> m_lstOrder;
+	map<string, ZIdentity> m_mapIdentities;
+};
+
+//spki sha256 of every DeveloperCertificates entry of a profile, so a private key pairs with one lookup.
+//built once per profile and saved next to it as <profile>.certindex, tied to the profile data by its sha256.
+class ZCertIndex
+{
+public:
+	bool Load(const string &strProvisionFile, const string &strProvisionData, JValue *pjvProv = NULL);
+	bool Find(const string &strSPKISHA256, uint32_t &uCertIndex);
+
+public:
+	static bool GetSPKISHA256(void *evpPkey, string &strSPKISHA256);
+	static bool FindProfiles(const string &strPKeyFile, const string &strPassword, const vector<string> &arrProvisionFiles, vector<string> &arrAcceptedFiles);
+
+private:
+	bool Build(JValue &jvProv);
+	bool Read(const string &strIndexFile);
+	bool Write(const string &strIndexFile);
+
+private:
+	string m_strProvisionSHA256;
+	map<string, uint32_t> m_mapCerts; //spki sha256 => DeveloperCertificates index
+};
+
 class ZSignAsset
 {
 public:
 	ZSignAsset();
+	~ZSignAsset();
 
 public:
 	bool GenerateCMS(const string &strCDHashData, const string &strCDHashesPlist, string &strCMSOutput);
@@ -20,8 +127,18 @@ public:
 	string m_strSubjectCN;
 	string m_strProvisionData;
 	string m_strEntitlementsData;
+	uint32_t m_uThreads;
+	bool m_bIncremental;
+	set<string> m_setThinArches; //keep only these slices of fat files, empty keeps all
+	uint32_t m_uCMSSignatureSlotLimit; //0 until the first size planning
+
+private:
+	ZSignAsset(const ZSignAsset &);
+	ZSignAsset &operator=(const ZSignAsset &);
+	void Free();
 
 private:
 	void *m_evpPkey;
 	void *m_x509Cert;
+	ZCMSSigner m_cmsSigner;
 };
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "common/json.h"
 #include "common/mach-o.h"
 #include "openssl.h"
+#include "signing.h"
 
 uint32_t SlotParseGeneralHeader(const char *szSlotName, uint8_t *pSlotBase, CS_BlobIndex *pbi)
 {
@@ -277,22 +278,67 @@ bool SlotParseCodeDirectory(uint8_t *pSlotBase, CS_BlobIndex *pbi)
 	return true;
 }
 
-bool SlotBuildCodeDirectory(
+#define MIN_CODE_SLOTS_PER_THREAD 256
+#define CODE_PAGES_PER_BATCH 8
+
+void SlotHashCodePages(uint8_t *pCodeBase, uint64_t uCodeLength, uint32_t uPageSize, uint8_t *pCodeSlots1, uint8_t *pCodeSlots256, uint32_t uThreads)
+{
+	uint32_t uCodeSlots = (uint32_t)(uCodeLength / uPageSize + ((uCodeLength % uPageSize) > 0 ? 1 : 0));
+
+	uint32_t uMaxThreads = uCodeSlots / MIN_CODE_SLOTS_PER_THREAD;
+	uThreads = GetThreadCount(uThreads);
+	if (uThreads > uMaxThreads)
+	{
+		uThreads = (uMaxThreads > 0) ? uMaxThreads : 1;
+	}
+
+	uint32_t uFullPages = (uint32_t)(uCodeLength / uPageSize);
+	ParallelFor(uCodeSlots, uThreads, [&](uint32_t uBegin, uint32_t uEnd) {
+		//full pages go through the batch kernel a group at a time, so both digests see the group while it is still in cache
+		uint32_t uBatchEnd = (uEnd < uFullPages) ? uEnd : uFullPages;
+		for (uint32_t i = uBegin; i < uBatchEnd; i += CODE_PAGES_PER_BATCH)
+		{
+			uint32_t uCount = (uBatchEnd - i < CODE_PAGES_PER_BATCH) ? (uBatchEnd - i) : CODE_PAGES_PER_BATCH;
+			if (NULL != pCodeSlots1)
+			{
+				SHASumBatch(E_SHASUM_TYPE_1, pCodeBase + (uint64_t)uPageSize * i, uPageSize, uCount, pCodeSlots1 + 20 * i);
+			}
+			if (NULL != pCodeSlots256)
+			{
+				SHASumBatch(E_SHASUM_TYPE_256, pCodeBase + (uint64_t)uPageSize * i, uPageSize, uCount, pCodeSlots256 + 32 * i);
+			}
+		}
+
+		for (uint32_t i = (uBegin > uBatchEnd) ? uBegin : uBatchEnd; i < uEnd; i++)
+		{
+			uint64_t uOffset = (uint64_t)uPageSize * i;
+			uint32_t uSize = (uint32_t)(uCodeLength - uOffset);
+			if (NULL != pCodeSlots1)
+			{
+				SHASum(E_SHASUM_TYPE_1, pCodeBase + uOffset, uSize, pCodeSlots1 + 20 * i);
+			}
+			if (NULL != pCodeSlots256)
+			{
+				SHASum(E_SHASUM_TYPE_256, pCodeBase + uOffset, uSize, pCodeSlots256 + 32 * i);
+			}
+		}
+	});
+}
+
+bool SlotBuildCodeDirectoryHeader(
 	bool bAlternate,
-	uint8_t *pCodeBase,
-	uint32_t uCodeLength,
-	uint8_t *pCodeSlotsData,
-	uint32_t uCodeSlotsDataLength,
+	uint64_t uCodeLength,
 	const string &strBundleId,
 	const string &strTeamId,
 	const string &strInfoPlistSHA,
 	const string &strRequirementsSlotSHA,
 	const string &strCodeResourcesSHA,
 	const string &strEntitlementsSlotSHA,
+	uint32_t &uCodeSlotsOffset,
 	string &strOutput)
 {
 	strOutput.clear();
-	if (NULL == pCodeBase || uCodeLength <= 0 || strBundleId.empty() || strTeamId.empty())
+	if (uCodeLength <= 0 || strBundleId.empty() || strTeamId.empty())
 	{
 		return false;
 	}
@@ -309,7 +355,15 @@ bool SlotBuildCodeDirectory(
 	cdHeader.identOffset = 0;
 	cdHeader.nSpecialSlots = 0;
 	cdHeader.nCodeSlots = 0;
-	cdHeader.codeLimit = BE(uCodeLength);
+	if (uCodeLength > UINT32_MAX)
+	{ //codeLimit64 is part of every version since 0x20300
+		cdHeader.codeLimit = BE((uint32_t)UINT32_MAX);
+		cdHeader.codeLimit64 = BE(uCodeLength);
+	}
+	else
+	{
+		cdHeader.codeLimit = BE((uint32_t)uCodeLength);
+	}
 	cdHeader.hashSize = bAlternate ? 32 : 20;
 	cdHeader.hashType = bAlternate ? 2 : 1;
 	cdHeader.spare1 = 0;
@@ -328,9 +382,14 @@ bool SlotBuildCodeDirectory(
 	arrSpecialSlots.push_back(strInfoPlistSHA.empty() ? strEmptySHA : strInfoPlistSHA);
 
 	uint32_t uPageSize = (uint32_t)pow(2, cdHeader.pageSize);
-	uint32_t uPages = uCodeLength / uPageSize;
-	uint32_t uRemain = uCodeLength % uPageSize;
-	uint32_t uCodeSlots = uPages + (uRemain > 0 ? 1 : 0);
+	uint64_t uPages = uCodeLength / uPageSize;
+	uint64_t uRemain = uCodeLength % uPageSize;
+	if (uPages + 1 > UINT32_MAX / 64)
+	{
+		ZLog::ErrorV(">>> Code Is Too Large To Sign! %llu\n", (unsigned long long)uCodeLength);
+		return false;
+	}
+	uint32_t uCodeSlots = (uint32_t)uPages + (uRemain > 0 ? 1 : 0);
 
 	uint32_t uHeaderLength = 44;
 	if (uVersion >= 0x20100)
@@ -401,24 +460,94 @@ bool SlotBuildCodeDirectory(
 		strOutput.append(arrSpecialSlots[i].data(), arrSpecialSlots[i].size());
 	}
 
-	if (NULL != pCodeSlotsData && (uCodeSlotsDataLength == uCodeSlots * cdHeader.hashSize))
+	uCodeSlotsOffset = (uint32_t)strOutput.size();
+	strOutput.append(uCodeSlotsLength, 0);
+	return true;
+}
+
+bool SlotBuildCodeDirectories(
+	uint8_t *pCodeBase,
+	uint64_t uCodeLength,
+	uint8_t *pCodeSlots1Data,
+	uint32_t uCodeSlots1DataLength,
+	uint8_t *pCodeSlots256Data,
+	uint32_t uCodeSlots256DataLength,
+	const string &strBundleId,
+	const string &strTeamId,
+	const string &strInfoPlistSHA1,
+	const string &strInfoPlistSHA256,
+	const string &strRequirementsSlotSHA1,
+	const string &strRequirementsSlotSHA256,
+	const string &strCodeResourcesSHA1,
+	const string &strCodeResourcesSHA256,
+	const string &strEntitlementsSlotSHA1,
+	const string &strEntitlementsSlotSHA256,
+	const set<uint32_t> &setDirtyPages,
+	uint32_t uThreads,
+	string &strCodeDirectorySlot,
+	string &strAltnateCodeDirectorySlot)
+{
+	uint32_t uCodeSlots1Offset = 0;
+	uint32_t uCodeSlots256Offset = 0;
+	if (NULL == pCodeBase
+		|| !SlotBuildCodeDirectoryHeader(false, uCodeLength, strBundleId, strTeamId, strInfoPlistSHA1, strRequirementsSlotSHA1, strCodeResourcesSHA1, strEntitlementsSlotSHA1, uCodeSlots1Offset, strCodeDirectorySlot)
+		|| !SlotBuildCodeDirectoryHeader(true, uCodeLength, strBundleId, strTeamId, strInfoPlistSHA256, strRequirementsSlotSHA256, strCodeResourcesSHA256, strEntitlementsSlotSHA256, uCodeSlots256Offset, strAltnateCodeDirectorySlot))
+	{
+		strCodeDirectorySlot.clear();
+		strAltnateCodeDirectorySlot.clear();
+		return false;
+	}
+
+	uint8_t *pCodeSlots1 = (uint8_t *)&strCodeDirectorySlot[uCodeSlots1Offset];
+	uint8_t *pCodeSlots256 = (uint8_t *)&strAltnateCodeDirectorySlot[uCodeSlots256Offset];
+	uint32_t uCodeSlots1Length = (uint32_t)strCodeDirectorySlot.size() - uCodeSlots1Offset;
+	uint32_t uCodeSlots256Length = (uint32_t)strAltnateCodeDirectorySlot.size() - uCodeSlots256Offset;
+	bool bReuse1 = (NULL != pCodeSlots1Data && (uCodeSlots1DataLength == uCodeSlots1Length));
+	bool bReuse256 = (NULL != pCodeSlots256Data && (uCodeSlots256DataLength == uCodeSlots256Length));
+	if (bReuse1)
 	{ //use exists
-		strOutput.append((const char *)pCodeSlotsData, uCodeSlotsDataLength);
+		memcpy(pCodeSlots1, pCodeSlots1Data, uCodeSlots1DataLength);
 	}
-	else
-	{
-		for (uint32_t i = 0; i < uPages; i++)
+	if (bReuse256)
+	{ //use exists
+		memcpy(pCodeSlots256, pCodeSlots256Data, uCodeSlots256DataLength);
+	}
+
+	if (!bReuse1 || !bReuse256)
+	{ //read each page once for both digests
+		SlotHashCodePages(pCodeBase, uCodeLength, CODE_PAGE_SIZE, bReuse1 ? NULL : pCodeSlots1, bReuse256 ? NULL : pCodeSlots256, uThreads);
+	}
+
+	if (bReuse1 || bReuse256)
+	{ //rehash the pages modified since the old signature was made
+		uint32_t uCodeSlots = uCodeSlots256Length / 32;
+		for (set<uint32_t>::const_iterator it = setDirtyPages.begin(); it != setDirtyPages.end() && *it < uCodeSlots; it++)
 		{
-			string strSHASum;
-			SHASum(cdHeader.hashType, pCodeBase + uPageSize * i, uPageSize, strSHASum);
-			strOutput.append(strSHASum.data(), strSHASum.size());
+			uint64_t uOffset = (uint64_t)CODE_PAGE_SIZE * (*it);
+			uint32_t uSize = (uCodeLength - uOffset > CODE_PAGE_SIZE) ? CODE_PAGE_SIZE : (uint32_t)(uCodeLength - uOffset);
+			if (bReuse1)
+			{
+				SHASum(E_SHASUM_TYPE_1, pCodeBase + uOffset, uSize, pCodeSlots1 + 20 * (*it));
+			}
+			if (bReuse256)
+			{
+				SHASum(E_SHASUM_TYPE_256, pCodeBase + uOffset, uSize, pCodeSlots256 + 32 * (*it));
+			}
 		}
-		if (uRemain > 0)
+
+#ifdef DEBUG
+		string strFullSlots1;
+		string strFullSlots256;
+		strFullSlots1.append(uCodeSlots1Length, 0);
+		strFullSlots256.append(uCodeSlots256Length, 0);
+		SlotHashCodePages(pCodeBase, uCodeLength, CODE_PAGE_SIZE, (uint8_t *)&strFullSlots1[0], (uint8_t *)&strFullSlots256[0], uThreads);
+		if (0 != memcmp(pCodeSlots1, strFullSlots1.data(), uCodeSlots1Length) || 0 != memcmp(pCodeSlots256, strFullSlots256.data(), uCodeSlots256Length))
 		{
-			string strSHASum;
-			SHASum(cdHeader.hashType, pCodeBase + uPageSize * uPages, uRemain, strSHASum);
-			strOutput.append(strSHASum.data(), strSHASum.size());
+			ZLog::ErrorV(">>> Reused CodeSlots Mismatch! %u Dirty Pages, Use Full Rehash.\n", (uint32_t)setDirtyPages.size());
+			memcpy(pCodeSlots1, strFullSlots1.data(), uCodeSlots1Length);
+			memcpy(pCodeSlots256, strFullSlots256.data(), uCodeSlots256Length);
 		}
+#endif
 	}
 
 	return true;
@@ -524,6 +653,35 @@ bool SlotBuildCMSSignature(
 	return true;
 }
 
+uint32_t GetCodeDirectorySlotLength(bool bAlternate, uint64_t uCodeLength, const string &strBundleId, const string &strTeamId)
+{
+	uint32_t uCodeSlotsOffset = 0;
+	string strCodeDirectorySlot;
+	if (!SlotBuildCodeDirectoryHeader(bAlternate, uCodeLength, strBundleId, strTeamId, "", "", "", "", uCodeSlotsOffset, strCodeDirectorySlot))
+	{
+		return 0;
+	}
+	return (uint32_t)strCodeDirectorySlot.size();
+}
+
+uint32_t GetCMSSignatureSlotLimit(ZSignAsset *pSignAsset)
+{
+	//the cms is detached and the cdhashes plist has a fixed shape, so its size only depends on the key and certs.
+	//sign a dummy once per asset, the slack covers the signing time and der length changes.
+	static mutex s_mutex;
+	lock_guard<mutex> lock(s_mutex);
+	if (0 == pSignAsset->m_uCMSSignatureSlotLimit)
+	{
+		string strCMSSignatureSlot;
+		if (!SlotBuildCMSSignature(pSignAsset, "ZSign", "ZSign", strCMSSignatureSlot))
+		{
+			return 0;
+		}
+		pSignAsset->m_uCMSSignatureSlotLimit = (uint32_t)strCMSSignatureSlot.size() + CMS_SIGNATURE_SLOT_SLACK;
+	}
+	return pSignAsset->m_uCMSSignatureSlotLimit;
+}
+
 uint32_t GetCodeSignatureLength(uint8_t *pCSBase)
 {
 	CS_SuperBlob *psb = (CS_SuperBlob *)pCSBase;
@@ -600,6 +758,56 @@ bool SlotGetCodeSlotsData(uint8_t *pSlotBase, uint8_t *&pCodeSlots, uint32_t &uC
 	return true;
 }
 
+bool GetCodeSignatureReusableCodeSlotsData(uint8_t *pCSBase, uint64_t uCodeLength, uint8_t *&pCodeSlots1Data, uint32_t &uCodeSlots1DataLength, uint8_t *&pCodeSlots256Data, uint32_t &uCodeSlots256DataLength)
+{
+	pCodeSlots1Data = NULL;
+	pCodeSlots256Data = NULL;
+	uCodeSlots1DataLength = 0;
+	uCodeSlots256DataLength = 0;
+	CS_SuperBlob *psb = (CS_SuperBlob *)pCSBase;
+	if (NULL == psb || CSMAGIC_EMBEDDED_SIGNATURE != LE(psb->magic))
+	{
+		return false;
+	}
+
+	uint32_t uCodeSlots = (uint32_t)(uCodeLength / CODE_PAGE_SIZE + ((uCodeLength % CODE_PAGE_SIZE) > 0 ? 1 : 0));
+	CS_BlobIndex *pbi = (CS_BlobIndex *)(pCSBase + sizeof(CS_SuperBlob));
+	for (uint32_t i = 0; i < LE(psb->count); i++, pbi++)
+	{
+		uint32_t uSlotType = LE(pbi->type);
+		if (CSSLOT_CODEDIRECTORY != uSlotType && CSSLOT_ALTERNATE_CODEDIRECTORIES != uSlotType)
+		{
+			continue;
+		}
+
+		//only trust slots made with the same page size, hash and code range
+		uint8_t *pSlotBase = pCSBase + LE(pbi->offset);
+		CS_CodeDirectory cdHeader = *((CS_CodeDirectory *)pSlotBase);
+		uint64_t uCodeLimit = LE(cdHeader.codeLimit);
+		if (LE(cdHeader.version) >= 0x20300 && 0 != cdHeader.codeLimit64)
+		{
+			uCodeLimit = LE(cdHeader.codeLimit64);
+		}
+		if (CSMAGIC_CODEDIRECTORY != LE(cdHeader.magic) || 12 != cdHeader.pageSize || uCodeLimit != uCodeLength || LE(cdHeader.nCodeSlots) != uCodeSlots)
+		{
+			continue;
+		}
+
+		if (CS_HASHTYPE_SHA1 == cdHeader.hashType && 20 == cdHeader.hashSize)
+		{
+			pCodeSlots1Data = pSlotBase + LE(cdHeader.hashOffset);
+			uCodeSlots1DataLength = uCodeSlots * 20;
+		}
+		else if (CS_HASHTYPE_SHA256 == cdHeader.hashType && 32 == cdHeader.hashSize)
+		{
+			pCodeSlots256Data = pSlotBase + LE(cdHeader.hashOffset);
+			uCodeSlots256DataLength = uCodeSlots * 32;
+		}
+	}
+
+	return ((NULL != pCodeSlots1Data) && (NULL != pCodeSlots256Data));
+}
+
 bool GetCodeSignatureExistsCodeSlotsData(uint8_t *pCSBase, uint8_t *&pCodeSlots1Data, uint32_t &uCodeSlots1DataLength, uint8_t *&pCodeSlots256Data, uint32_t &uCodeSlots256DataLength)
 {
 	pCodeSlots1Data = NULL;
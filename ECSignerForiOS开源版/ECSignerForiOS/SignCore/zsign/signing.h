@@ -1,23 +1,37 @@
 #pragma once
 #include "openssl.h"
 
+#define CODE_PAGE_SIZE 4096
+#define CMS_SIGNATURE_SLOT_SLACK 64
+
 bool ParseCodeSignature(uint8_t *pCSBase);
 uint32_t GetCodeSignatureLength(uint8_t *pCSBase);
 bool GetCodeSignatureCodeSlotsData(uint8_t *pCSBase, uint8_t *&pCodeSlots1, uint32_t &uCodeSlots1Length, uint8_t *&pCodeSlots256, uint32_t &uCodeSlots256Length);
 bool SlotBuildRequirements(const string &strBundleID, const string &strSubjectCN, string &strOutput);
 bool SlotBuildEntitlements(const string &strEntitlements, string &strOutput);
-bool SlotBuildCodeDirectory(
-	bool bAlternate,
+bool SlotBuildCodeDirectories(
 	uint8_t *pCodeBase,
-	uint32_t uCodeLength,
-	uint8_t *pCodeSlotsData,
-	uint32_t uCodeSlotsDataLength,
+	uint64_t uCodeLength,
+	uint8_t *pCodeSlots1Data,
+	uint32_t uCodeSlots1DataLength,
+	uint8_t *pCodeSlots256Data,
+	uint32_t uCodeSlots256DataLength,
 	const string &strBundleId,
 	const string &strTeamId,
-	const string &strInfoPlistSHA,
-	const string &strRequirementsSlotSHA,
-	const string &strCodeResourcesSHA,
-	const string &strEntitlementsSlotSHA,
-	string &strOutput);
+	const string &strInfoPlistSHA1,
+	const string &strInfoPlistSHA256,
+	const string &strRequirementsSlotSHA1,
+	const string &strRequirementsSlotSHA256,
+	const string &strCodeResourcesSHA1,
+	const string &strCodeResourcesSHA256,
+	const string &strEntitlementsSlotSHA1,
+	const string &strEntitlementsSlotSHA256,
+	const set<uint32_t> &setDirtyPages,
+	uint32_t uThreads,
+	string &strCodeDirectorySlot,
+	string &strAltnateCodeDirectorySlot);
 bool SlotBuildCMSSignature(ZSignAsset *pSignAsset, const string &strCodeDirectorySlot, const string &strAltnateCodeDirectorySlot, string &strOutput);
-bool GetCodeSignatureExistsCodeSlotsData(uint8_t *pCSBase, uint8_t *&pCodeSlots1Data, uint32_t &uCodeSlots1DataLength, uint8_t *&pCodeSlots256Data, uint32_t &uCodeSlots256DataLength);
\ No newline at end of file
+uint32_t GetCodeDirectorySlotLength(bool bAlternate, uint64_t uCodeLength, const string &strBundleId, const string &strTeamId);
+uint32_t GetCMSSignatureSlotLimit(ZSignAsset *pSignAsset);
+bool GetCodeSignatureExistsCodeSlotsData(uint8_t *pCSBase, uint8_t *&pCodeSlots1Data, uint32_t &uCodeSlots1DataLength, uint8_t *&pCodeSlots256Data, uint32_t &uCodeSlots256DataLength);
+bool GetCodeSignatureReusableCodeSlotsData(uint8_t *pCSBase, uint64_t uCodeLength, uint8_t *&pCodeSlots1Data, uint32_t &uCodeSlots1DataLength, uint8_t *&pCodeSlots256Data, uint32_t &uCodeSlots256DataLength);
\ No newline at end of file
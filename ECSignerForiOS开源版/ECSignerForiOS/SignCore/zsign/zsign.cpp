@@ -1,5 +1,6 @@
 #include "common/common.h"
 #include "common/json.h"
+#include "common/digeststore.h"
 #include "openssl.h"
 #include "macho.h"
 #include "bundle.h"
@@ -26,6 +27,12 @@ struct optparse_long longopts[] = {
 	{ "weak",			'w', OPTPARSE_NONE  },
 	{ "install",		'i', OPTPARSE_NONE  },
 	{ "quiet",			'q', OPTPARSE_NONE  },
+	{ "threads",		't', OPTPARSE_REQUIRED },
+	{ "incremental",	'r', OPTPARSE_REQUIRED },
+	{ "digests",		's', OPTPARSE_REQUIRED },
+	{ "arches",			'a', OPTPARSE_REQUIRED },
+	{ "max-rss",		'x', OPTPARSE_REQUIRED },
+	{ "accepts",		'g', OPTPARSE_REQUIRED },
 	{ "help",			'h', OPTPARSE_NONE  },
 	{ 0 }
 };
@@ -45,10 +52,16 @@ int usage()
 	ZLog::Print("-n, --bundlename\tNew bundle name to change.\n");
 	ZLog::Print("-e, --entitlements\tNew entitlements to change.\n");
 	ZLog::Print("-z, --ziplevel\t\tCompressed level when output the ipa file. (0-9)\n");
-	ZLog::Print("-l, --dylib\t\tPath to inject dylib file.\n");
-	ZLog::Print("-w, --weak\t\tInject dylib as LC_LOAD_WEAK_DYLIB.\n");
+	ZLog::Print("-l, --dylib\t\tPath to inject dylib file. (can be repeated)\n");
+	ZLog::Print("-w, --weak\t\tInject dylib as LC_LOAD_WEAK_DYLIB. (0/1)\n");
 	ZLog::Print("-i, --install\t\tInstall ipa file using ideviceinstaller command for test.\n");
 	ZLog::Print("-q, --quiet\t\tQuiet operation.\n");
+	ZLog::Print("-t, --threads\t\tWorker threads used for hashing. (0 = all cores)\n");
+	ZLog::Print("-r, --incremental\tReuse existing code slots, only rehash modified pages. (0/1)\n");
+	ZLog::Print("-s, --digests\t\tPath to digest store shared by all signings, identical files are hashed once.\n");
+	ZLog::Print("-a, --arches\t\tKeep only these slices of fat Mach-O files before signing. (e.g. arm64,arm64e)\n");
+	ZLog::Print("-x, --max-rss\t\tMemory budget for mapped files and read buffers of all threads. (e.g. 512M)\n");
+	ZLog::Print("-g, --accepts\t\tList which of these profiles accept the private key, then exit. (can be repeated)\n");
 	ZLog::Print("-v, --version\t\tShow version.\n");
 	ZLog::Print("-h, --help\t\tShow help.\n");
 
@@ -63,6 +76,8 @@ int zsign(int argc, char * argv[])
 	bool bInstall = false;
 	bool bWeakInject = false;
 	uint32_t uZipLevel = 5;
+	uint32_t uThreads = 0;
+	bool bIncremental = false;
 
 	string strCertFile;
 	string strPKeyFile;
@@ -73,7 +88,11 @@ int zsign(int argc, char * argv[])
     string strDisplayName;
     string strEntitlementsFile;
     string strOutputFile;
+    string strDigestStoreFile;
     string fromIpaPath;
+    vector<string> arrDyLibFiles;
+    vector<string> arrThinArches;
+    vector<string> arrAcceptProvFiles;
 
     for (int i = 0; i < argc; i += 2) {
         
@@ -118,6 +137,52 @@ int zsign(int argc, char * argv[])
             uZipLevel = atoi(argv[i+1]);
             
             
+        } else if (strcmp(option, "-t") == 0) {
+            
+            uThreads = atoi(argv[i+1]);
+            
+            
+        } else if (strcmp(option, "-r") == 0) {
+            
+            bIncremental = (0 != atoi(argv[i+1]));
+            
+            
+        } else if (strcmp(option, "-s") == 0) {
+            
+            strDigestStoreFile = argv[i+1];
+            
+            
+        } else if (strcmp(option, "-l") == 0) {
+            
+            arrDyLibFiles.push_back(argv[i+1]);
+            
+            
+        } else if (strcmp(option, "-w") == 0) {
+            
+            bWeakInject = (0 != atoi(argv[i+1]));
+            
+            
+        } else if (strcmp(option, "-a") == 0) {
+            
+            StringSplit(argv[i+1], ",", arrThinArches);
+            
+            
+        } else if (strcmp(option, "-x") == 0) {
+            
+            int64_t nMaxRSS = ParseSize(argv[i+1]);
+            if (nMaxRSS < 0)
+            {
+                ZLog::ErrorV(">>> Invalid Memory Budget! %s\n", argv[i+1]);
+                return -1;
+            }
+            ZMemoryBudget::SetLimit((uint64_t)nMaxRSS);
+            
+            
+        } else if (strcmp(option, "-g") == 0) {
+            
+            arrAcceptProvFiles.push_back(argv[i+1]);
+            
+            
         } else if (strcmp(option, "-i") == 0) {
             
             fromIpaPath = argv[i+1];
@@ -126,6 +191,20 @@ int zsign(int argc, char * argv[])
 
     }
 
+    if (!arrAcceptProvFiles.empty())
+    { //bulk query, no signing
+        vector<string> arrAcceptedFiles;
+        if (!ZCertIndex::FindProfiles(strPKeyFile, strPassword, arrAcceptProvFiles, arrAcceptedFiles))
+        {
+            return -2;
+        }
+        for (size_t i = 0; i < arrAcceptedFiles.size(); i++)
+        {
+            ZLog::PrintV("%s\n", arrAcceptedFiles[i].c_str());
+        }
+        return 0;
+    }
+
     string strPath = fromIpaPath;
     
 	if (!IsFileExists(strPath.c_str()))
@@ -141,10 +220,31 @@ int zsign(int argc, char * argv[])
 		if (!bZipFile)
 		{ //macho file
 			ZMachO macho;
-			if (macho.Init(strPath.c_str()))
+			if (!macho.Init(strPath.c_str()))
 			{
-				macho.Free();
+				return -1;
 			}
+
+			if (!arrDyLibFiles.empty())
+			{ //inject dylibs, the paths are used as they are
+				vector<ZLoadCommandEdit> arrEdits;
+				for (size_t i = 0; i < arrDyLibFiles.size(); i++)
+				{
+					ZLoadCommandEdit edit;
+					edit.uType = E_LOAD_COMMAND_INJECT;
+					edit.strPath = arrDyLibFiles[i];
+					edit.bWeak = bWeakInject;
+					arrEdits.push_back(edit);
+				}
+
+				bool bChanged = false;
+				if (!macho.EditLoadCommands(arrEdits, bChanged))
+				{
+					macho.Free();
+					return -1;
+				}
+			}
+			macho.Free();
 			return 0;
 		}
 	}
@@ -155,6 +255,14 @@ int zsign(int argc, char * argv[])
 	{
 		return -2;
 	}
+	zSignAsset.m_uThreads = uThreads;
+	ZThreadBudget::SetLimit(uThreads);
+	zSignAsset.m_bIncremental = bIncremental;
+	zSignAsset.m_setThinArches.insert(arrThinArches.begin(), arrThinArches.end());
+	if (ZLog::IsDebug())
+	{
+		ZLog::DebugV(">>> Hash:\t%s, %u threads\n", GetSHABackendName(), GetThreadCount(uThreads));
+	}
 
 
     MyCPPClass *temp = new MyCPPClass();
@@ -181,9 +289,18 @@ int zsign(int argc, char * argv[])
     
     //resign and inject libs
 	timer.Reset();
+	if (!strDigestStoreFile.empty())
+	{
+		ZDigestStore::Shared().Open(strDigestStoreFile.c_str());
+	}
 	ZAppBundle bundle;
-    bool bRet = bundle.SignFolder(&zSignAsset, strFolder, strBundleVersion, strBundleId, strDisplayName, bForce, bWeakInject, bEnableCache);
+    bool bRet = bundle.SignFolder(&zSignAsset, strFolder, strBundleVersion, strBundleId, strDisplayName, arrDyLibFiles, bForce, bWeakInject, bEnableCache);
 	timer.PrintResult(bRet, ">>> Signed %s!", bRet ? "OK" : "Failed");
+	if (bRet && ZDigestStore::Shared().IsOpened())
+	{
+		ZDigestStore::Shared().Save();
+		ZDigestStore::Shared().PrintStats();
+	}
     if (bRet == false)
     {
         return -7;